@@ -23,15 +23,88 @@
 #ifdef HAVE_SHADOW
 #include <shadow.h>
 #endif
+#include <libubox/avl.h>
 #include "uhttpd.h"
 
-static LIST_HEAD(auth_realms);
+#define UH_AUTH_CACHE_SIZE	32
+
+/* all realms protecting one path, in lookup order */
+struct auth_path {
+	struct avl_node avl;
+	struct list_head realms;
+	int len;
+};
+
+struct auth_cache_entry {
+	time_t expires;
+	unsigned int hash;
+	const struct auth_realm *realm;
+	char auth[];
+};
+
+static int auth_path_cmp(const void *k1, const void *k2, void *ptr)
+{
+	return strcasecmp(k1, k2);
+}
+
+static AVL_TREE(auth_paths, auth_path_cmp, false, NULL);
+
+/* distinct realm path lengths, longest first */
+static int *auth_lens;
+static int n_auth_lens;
+
+static struct auth_cache_entry *auth_cache[UH_AUTH_CACHE_SIZE];
+
+static void uh_auth_len_add(int len)
+{
+	int *lens;
+	int i;
+
+	for (i = 0; i < n_auth_lens; i++) {
+		if (auth_lens[i] == len)
+			return;
+		if (auth_lens[i] < len)
+			break;
+	}
+
+	lens = realloc(auth_lens, (n_auth_lens + 1) * sizeof(*lens));
+	if (!lens)
+		return;
+
+	memmove(&lens[i + 1], &lens[i], (n_auth_lens - i) * sizeof(*lens));
+	lens[i] = len;
+	auth_lens = lens;
+	n_auth_lens++;
+}
+
+static struct auth_path *uh_auth_path_get(const char *path)
+{
+	struct auth_path *ap;
+	char *key;
+
+	ap = avl_find_element(&auth_paths, path, ap, avl);
+	if (ap)
+		return ap;
+
+	ap = calloc_a(sizeof(*ap), &key, strlen(path) + 1);
+	if (!ap)
+		return NULL;
+
+	ap->avl.key = strcpy(key, path);
+	ap->len = strlen(path);
+	INIT_LIST_HEAD(&ap->realms);
+	avl_insert(&auth_paths, &ap->avl);
+	uh_auth_len_add(ap->len);
+
+	return ap;
+}
 
 void uh_auth_add(const char *path, const char *user, const char *pass)
 {
 	struct auth_realm *new = NULL;
 	struct passwd *pwd;
 	const char *new_pass = NULL;
+	struct auth_path *ap;
 	char *dest_path, *dest_user, *dest_pass;
 
 #ifdef HAVE_SHADOW
@@ -59,6 +132,10 @@ void uh_auth_add(const char *path, const char *user, const char *pass)
 	if (!new_pass || !new_pass[0])
 		return;
 
+	ap = uh_auth_path_get(path);
+	if (!ap)
+		return;
+
 	new = calloc_a(sizeof(*new),
 		&dest_path, strlen(path) + 1,
 		&dest_user, strlen(user) + 1,
@@ -70,20 +147,131 @@ void uh_auth_add(const char *path, const char *user, const char *pass)
 	new->path = strcpy(dest_path, path);
 	new->user = strcpy(dest_user, user);
 	new->pass = strcpy(dest_pass, new_pass);
-	list_add(&new->list, &auth_realms);
+	list_add(&new->list, &ap->realms);
+}
+
+static unsigned int uh_auth_hash(const char *auth)
+{
+	unsigned int hash = 5381;
+
+	while (*auth)
+		hash = (hash * 33) ^ (unsigned char) *auth++;
+
+	return hash;
+}
+
+static time_t uh_auth_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/*
+ * Credentials that passed crypt() once are remembered for a while. The hash
+ * only selects the slot, a hit needs the same realm and a byte for byte match
+ * of the Authorization value.
+ */
+static bool uh_auth_cache_get(const struct auth_realm *realm, const char *auth,
+			      unsigned int hash)
+{
+	struct auth_cache_entry **slot, *e;
+
+	if (conf.auth_cache_ttl <= 0)
+		return false;
+
+	slot = &auth_cache[hash % UH_AUTH_CACHE_SIZE];
+	e = *slot;
+
+	if (!e || e->hash != hash || e->realm != realm || strcmp(e->auth, auth))
+		return false;
+
+	if (uh_auth_now() >= e->expires) {
+		free(e);
+		*slot = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static void uh_auth_cache_add(const struct auth_realm *realm, const char *auth,
+			      unsigned int hash)
+{
+	struct auth_cache_entry **slot, *e;
+	int len = strlen(auth);
+
+	if (conf.auth_cache_ttl <= 0)
+		return;
+
+	e = malloc(sizeof(*e) + len + 1);
+	if (!e)
+		return;
+
+	e->expires = uh_auth_now() + conf.auth_cache_ttl;
+	e->hash = hash;
+	e->realm = realm;
+	memcpy(e->auth, auth, len + 1);
+
+	slot = &auth_cache[hash % UH_AUTH_CACHE_SIZE];
+	free(*slot);
+	*slot = e;
+}
+
+/* realm list of the longest realm path that prefixes name */
+static struct auth_path *uh_auth_path_find(char *name, int len, int *idx)
+{
+	struct auth_path *ap;
+	char c;
+
+	for (; *idx < n_auth_lens; (*idx)++) {
+		int rlen = auth_lens[*idx];
+
+		if (rlen > len)
+			continue;
+
+		c = name[rlen];
+		name[rlen] = 0;
+		ap = avl_find_element(&auth_paths, name, ap, avl);
+		name[rlen] = c;
+
+		if (ap) {
+			(*idx)++;
+			return ap;
+		}
+	}
+
+	return NULL;
 }
 
 bool uh_auth_check(struct client *cl, struct path_info *pi)
 {
 	struct http_request *req = &cl->request;
 	struct auth_realm *realm;
+	struct auth_path *ap;
+	const char *auth = NULL;
 	bool user_match = false;
+	char name[PATH_MAX];
 	char *user = NULL;
 	char *pass = NULL;
-	int plen;
+	unsigned int hash;
+	int plen, idx = 0;
+
+	req->realm = NULL;
+	plen = min(strlen(pi->name), sizeof(name) - 1);
+	memcpy(name, pi->name, plen);
+	name[plen] = 0;
+
+	ap = uh_auth_path_find(name, plen, &idx);
+	if (!ap)
+		return true;
+
+	req->realm = list_first_entry(&ap->realms, struct auth_realm, list);
 
 	if (pi->auth && !strncasecmp(pi->auth, "Basic ", 6)) {
-		const char *auth = pi->auth + 6;
+		auth = pi->auth + 6;
 
 		uh_b64decode(uh_buf, sizeof(uh_buf), auth, strlen(auth));
 		pass = strchr(uh_buf, ':');
@@ -93,38 +281,38 @@ bool uh_auth_check(struct client *cl, struct path_info *pi)
 		}
 	}
 
-	req->realm = NULL;
-	plen = strlen(pi->name);
-	list_for_each_entry(realm, &auth_realms, list) {
-		int rlen = strlen(realm->path);
-
-		if (plen < rlen)
-			continue;
+	while (user && ap) {
+		list_for_each_entry(realm, &ap->realms, list) {
+			if (strcmp(user, realm->user) != 0)
+				continue;
 
-		if (strncasecmp(pi->name, realm->path, rlen) != 0)
-			continue;
-
-		req->realm = realm;
-		if (!user)
+			req->realm = realm;
+			user_match = true;
 			break;
+		}
 
-		if (strcmp(user, realm->user) != 0)
-			continue;
+		if (user_match)
+			break;
 
-		user_match = true;
-		break;
+		ap = uh_auth_path_find(name, plen, &idx);
 	}
 
-	if (!req->realm)
-		return true;
+	if (user_match) {
+		realm = (struct auth_realm *) req->realm;
+		hash = uh_auth_hash(auth) ^ (unsigned long) realm;
 
-	if (user_match &&
-	    (!strcmp(pass, realm->pass) ||
-	     !strcmp(crypt(pass, realm->pass), realm->pass)))
-		return true;
+		if (uh_auth_cache_get(realm, auth, hash))
+			return true;
+
+		if (!strcmp(pass, realm->pass) ||
+		    !strcmp(crypt(pass, realm->pass), realm->pass)) {
+			uh_auth_cache_add(realm, auth, hash);
+			return true;
+		}
+	}
 
 	uh_http_header(cl, 401, "Authorization Required");
-	ustream_printf(cl->us,
+	uh_response_printf(cl,
 				  "WWW-Authenticate: Basic realm=\"%s\"\r\n"
 				  "Content-Type: text/plain\r\n\r\n",
 				  conf.realm);
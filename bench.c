@@ -0,0 +1,579 @@
+/*
+ * uhttpd-bench - HTTP load generator for uhttpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include <libubox/uloop.h>
+#include <libubox/ustream.h>
+#include <libubox/usock.h>
+#include <libubox/utils.h>
+#ifdef HAVE_TLS
+#include <libubox/ustream-ssl.h>
+#endif
+
+#define BENCH_MAX_PIPELINE	64
+
+enum bench_state {
+	RESP_STATUS,
+	RESP_HEADER,
+	RESP_BODY,
+	RESP_CHUNK_SIZE,
+	RESP_CHUNK_DATA,
+	RESP_CHUNK_END,
+	RESP_TRAILER,
+};
+
+struct bench_conn {
+	struct ustream_fd sfd;
+#ifdef HAVE_TLS
+	struct ustream_ssl ssl;
+#endif
+	struct ustream *us;
+	struct uloop_timeout restart;
+	bool open;
+	bool alloc;
+
+	uint64_t sent[BENCH_MAX_PIPELINE];
+	int head, pending;
+
+	enum bench_state state;
+	int status;
+	long remaining;
+	bool chunked;
+	bool until_eof;
+	bool close;
+};
+
+static const char *host = "127.0.0.1";
+static const char *port = "80";
+static const char *path = "/";
+static int n_conns = 10;
+static int pipeline = 1;
+static int duration;
+static long n_requests = 10000;
+static bool keepalive = true;
+static bool use_tls;
+
+static struct bench_conn *conns;
+static long n_sent, n_done, n_errors, n_non2xx, n_connects;
+static uint64_t t_start, t_end;
+static bool stopping;
+
+static uint32_t *lat;
+static long n_lat, lat_size;
+
+#ifdef HAVE_TLS
+static struct ustream_ssl_ops *ssl_ops;
+static void *ssl_ctx;
+#endif
+
+static void conn_open(struct bench_conn *c);
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool bench_budget(void)
+{
+	if (stopping)
+		return false;
+
+	if (duration)
+		return true;
+
+	return n_sent < n_requests;
+}
+
+static void bench_check_done(void)
+{
+	int i;
+
+	if (bench_budget())
+		return;
+
+	for (i = 0; i < n_conns; i++)
+		if (conns[i].pending)
+			return;
+
+	t_end = now_us();
+	uloop_end();
+}
+
+static void record_latency(uint64_t start)
+{
+	uint32_t *l;
+
+	if (n_lat == lat_size) {
+		lat_size = lat_size ? lat_size * 2 : 65536;
+		l = realloc(lat, lat_size * sizeof(*lat));
+		if (!l) {
+			perror("realloc");
+			exit(1);
+		}
+		lat = l;
+	}
+
+	lat[n_lat++] = now_us() - start;
+}
+
+static void conn_fill(struct bench_conn *c)
+{
+	int depth = keepalive ? pipeline : 1;
+	int idx;
+
+	while (c->open && c->pending < depth && bench_budget()) {
+		idx = (c->head + c->pending) % BENCH_MAX_PIPELINE;
+		c->sent[idx] = now_us();
+		c->pending++;
+		n_sent++;
+
+		ustream_printf(c->us, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+			       path, host, keepalive ? "" : "Connection: close\r\n");
+	}
+}
+
+static void conn_close(struct bench_conn *c)
+{
+	if (!c->alloc)
+		return;
+
+	c->alloc = false;
+#ifdef HAVE_TLS
+	if (use_tls)
+		ustream_free(&c->ssl.stream);
+#endif
+	ustream_free(&c->sfd.stream);
+	close(c->sfd.fd.fd);
+}
+
+static void conn_restart_cb(struct uloop_timeout *t)
+{
+	struct bench_conn *c = container_of(t, struct bench_conn, restart);
+
+	conn_close(c);
+	if (bench_budget())
+		conn_open(c);
+}
+
+/* the stream is replaced from a timeout, never from its own callbacks */
+static void conn_restart(struct bench_conn *c)
+{
+	/* whatever was still in flight on this connection is lost */
+	n_errors += c->pending;
+	c->pending = 0;
+	c->open = false;
+
+	c->restart.cb = conn_restart_cb;
+	uloop_timeout_set(&c->restart, 0);
+	bench_check_done();
+}
+
+static void response_done(struct bench_conn *c)
+{
+	record_latency(c->sent[c->head]);
+	c->head = (c->head + 1) % BENCH_MAX_PIPELINE;
+	c->pending--;
+	n_done++;
+
+	c->state = RESP_STATUS;
+	if (c->close || !keepalive) {
+		conn_restart(c);
+		return;
+	}
+
+	conn_fill(c);
+	bench_check_done();
+}
+
+/* returns false when more data is needed */
+static bool conn_parse(struct bench_conn *c)
+{
+	char *buf, *newline;
+	int len, cur;
+
+	buf = ustream_get_read_buf(c->us, &len);
+	if (!buf || !len)
+		return false;
+
+	switch (c->state) {
+	case RESP_BODY:
+	case RESP_CHUNK_DATA:
+		cur = (c->until_eof || c->remaining > len) ? len : c->remaining;
+		ustream_consume(c->us, cur);
+		if (c->until_eof)
+			return true;
+
+		c->remaining -= cur;
+		if (c->remaining)
+			return true;
+
+		if (c->state == RESP_CHUNK_DATA)
+			c->state = RESP_CHUNK_END;
+		else
+			response_done(c);
+
+		return true;
+	default:
+		break;
+	}
+
+	newline = memmem(buf, len, "\r\n", 2);
+	if (!newline)
+		return false;
+
+	*newline = 0;
+
+	switch (c->state) {
+	case RESP_STATUS:
+		if (strncmp(buf, "HTTP/1.", 7) || strlen(buf) < 12) {
+			n_errors++;
+			conn_restart(c);
+			return false;
+		}
+
+		c->status = atoi(buf + 9);
+		if (c->status < 200 || c->status > 299)
+			n_non2xx++;
+
+		c->chunked = false;
+		c->until_eof = false;
+		c->close = false;
+		c->remaining = -1;
+		c->state = RESP_HEADER;
+		break;
+
+	case RESP_HEADER:
+		if (!*buf) {
+			/* RFC2616 4.4, these never carry a body */
+			if (c->status == 204 || c->status == 304) {
+				c->chunked = false;
+				c->remaining = 0;
+			}
+
+			if (c->chunked) {
+				c->state = RESP_CHUNK_SIZE;
+			} else if (c->remaining > 0) {
+				c->state = RESP_BODY;
+			} else if (c->remaining < 0) {
+				c->until_eof = true;
+				c->close = true;
+				c->state = RESP_BODY;
+			} else {
+				ustream_consume(c->us, newline + 2 - buf);
+				response_done(c);
+				return true;
+			}
+		} else if (!strncasecmp(buf, "Content-Length:", 15)) {
+			c->remaining = strtol(buf + 15, NULL, 10);
+		} else if (!strncasecmp(buf, "Transfer-Encoding:", 18)) {
+			c->chunked = !!strcasestr(buf + 18, "chunked");
+		} else if (!strncasecmp(buf, "Connection:", 11)) {
+			c->close = !!strcasestr(buf + 11, "close");
+		}
+		break;
+
+	case RESP_CHUNK_SIZE:
+		c->remaining = strtol(buf, NULL, 16);
+		c->state = c->remaining ? RESP_CHUNK_DATA : RESP_TRAILER;
+		break;
+
+	case RESP_CHUNK_END:
+		c->state = RESP_CHUNK_SIZE;
+		break;
+
+	case RESP_TRAILER:
+		if (!*buf) {
+			ustream_consume(c->us, newline + 2 - buf);
+			response_done(c);
+			return true;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	ustream_consume(c->us, newline + 2 - buf);
+
+	return true;
+}
+
+static struct bench_conn *stream_conn(struct ustream *s)
+{
+#ifdef HAVE_TLS
+	if (use_tls)
+		return container_of(s, struct bench_conn, ssl.stream);
+#endif
+	return container_of(s, struct bench_conn, sfd.stream);
+}
+
+static void conn_read_cb(struct ustream *s, int bytes)
+{
+	struct bench_conn *c = stream_conn(s);
+
+	while (c->open && conn_parse(c));
+}
+
+static void conn_state_cb(struct ustream *s)
+{
+	struct bench_conn *c = stream_conn(s);
+
+	if (!c->open || (!s->eof && !s->write_error))
+		return;
+
+	/* a response without a length ends with the connection */
+	if (c->until_eof && c->pending) {
+		c->close = true;
+		response_done(c);
+		return;
+	}
+
+	conn_restart(c);
+}
+
+#ifdef HAVE_TLS
+static void conn_ssl_error(struct ustream_ssl *ssl, int error, const char *str)
+{
+	struct bench_conn *c = container_of(ssl, struct bench_conn, ssl);
+
+	fprintf(stderr, "TLS error: %s\n", str);
+	conn_restart(c);
+}
+#endif
+
+static void conn_open(struct bench_conn *c)
+{
+	int fd;
+
+	fd = usock(USOCK_TCP, host, port);
+	if (fd < 0) {
+		perror("usock");
+		exit(1);
+	}
+
+	n_connects++;
+	memset(&c->sfd, 0, sizeof(c->sfd));
+	c->us = &c->sfd.stream;
+	c->state = RESP_STATUS;
+
+#ifdef HAVE_TLS
+	if (use_tls) {
+		memset(&c->ssl, 0, sizeof(c->ssl));
+		c->ssl.notify_error = conn_ssl_error;
+		c->ssl.server_name = (char *) host;
+		ustream_fd_init(&c->sfd, fd);
+		ssl_ops->init(&c->ssl, &c->sfd.stream, ssl_ctx, false);
+		c->us = &c->ssl.stream;
+	}
+#endif
+
+	c->us->string_data = true;
+	c->us->notify_read = conn_read_cb;
+	c->us->notify_state = conn_state_cb;
+	if (!use_tls)
+		ustream_fd_init(&c->sfd, fd);
+
+	c->open = true;
+	c->alloc = true;
+	conn_fill(c);
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+	long idx = p * (n_lat - 1);
+
+	return lat[idx] / 1000.0;
+}
+
+static void report(void)
+{
+	double secs = (t_end - t_start) / 1e6;
+
+	qsort(lat, n_lat, sizeof(*lat), lat_cmp);
+
+	printf("requests:     %ld completed, %ld failed, %ld non-2xx\n",
+	       n_done, n_errors, n_non2xx);
+	printf("connections:  %ld opened, %d concurrent, pipeline depth %d\n",
+	       n_connects, n_conns, keepalive ? pipeline : 1);
+	printf("time:         %.3f s\n", secs);
+	printf("throughput:   %.1f requests/s\n", secs > 0 ? n_done / secs : 0);
+
+	if (!n_lat)
+		return;
+
+	printf("latency (ms): min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+	       percentile(0), percentile(0.5), percentile(0.9),
+	       percentile(0.99), percentile(1));
+}
+
+static void stop_cb(struct uloop_timeout *t)
+{
+	stopping = true;
+	bench_check_done();
+}
+
+static int parse_url(char *url)
+{
+	char *p;
+
+	if (!strncmp(url, "https://", 8)) {
+		use_tls = true;
+		port = "443";
+		url += 8;
+	} else if (!strncmp(url, "http://", 7)) {
+		url += 7;
+	} else {
+		return -1;
+	}
+
+	p = strchr(url, '/');
+	if (p) {
+		path = strdup(p);
+		*p = 0;
+	}
+
+	p = strrchr(url, ':');
+	if (p && !strchr(p, ']')) {
+		*p++ = 0;
+		port = p;
+	}
+
+	if (*url == '[') {
+		url++;
+		p = strchr(url, ']');
+		if (p)
+			*p = 0;
+	}
+
+	host = url;
+
+	return 0;
+}
+
+static int usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] http[s]://host[:port][/path]\n"
+		"	-c count        Number of concurrent connections, default is 10\n"
+		"	-n count        Total number of requests, default is 10000\n"
+		"	-t seconds      Run for the given time instead of a fixed count\n"
+		"	-P depth        Pipeline up to depth requests per connection, default is 1\n"
+		"	-K              Disable keep-alive, one connection per request\n"
+		"\n", name);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct uloop_timeout stop = { .cb = stop_cb };
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "c:n:t:P:K")) != -1) {
+		switch (ch) {
+		case 'c':
+			n_conns = atoi(optarg);
+			break;
+		case 'n':
+			n_requests = atol(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'P':
+			pipeline = atoi(optarg);
+			break;
+		case 'K':
+			keepalive = false;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (optind + 1 != argc || parse_url(argv[optind]))
+		return usage(argv[0]);
+
+	if (n_conns < 1 || pipeline < 1 || pipeline > BENCH_MAX_PIPELINE) {
+		fprintf(stderr, "Invalid connection count or pipeline depth\n");
+		return 1;
+	}
+
+	if (use_tls) {
+#ifdef HAVE_TLS
+		void *dlh = dlopen("libustream-ssl.so", RTLD_LAZY | RTLD_LOCAL);
+
+		ssl_ops = dlh ? dlsym(dlh, "ustream_ssl_ops") : NULL;
+		ssl_ctx = ssl_ops ? ssl_ops->context_new(false) : NULL;
+		if (!ssl_ctx) {
+			fprintf(stderr, "Failed to initialize ustream-ssl\n");
+			return 1;
+		}
+#else
+		fprintf(stderr, "Built without TLS support\n");
+		return 1;
+#endif
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	conns = calloc(n_conns, sizeof(*conns));
+	if (!conns)
+		return 1;
+
+	uloop_init();
+	t_start = now_us();
+
+	for (i = 0; i < n_conns; i++)
+		conn_open(&conns[i]);
+
+	if (duration)
+		uloop_timeout_set(&stop, duration * 1000);
+
+	uloop_run();
+	uloop_done();
+
+	if (!t_end)
+		t_end = now_us();
+
+	report();
+
+	return n_errors ? 2 : 0;
+}
@@ -37,51 +37,80 @@ void uh_interpreter_add(const char *ext, const char *path)
 	list_add_tail(&in->list, &interpreters);
 }
 
-static void cgi_main(struct client *cl, struct path_info *pi, char *url)
+/* builds the environment in one allocation, as setenv() is off limits after vfork() */
+static char **cgi_build_env(struct client *cl, struct path_info *pi)
 {
-	const struct interpreter *ip = pi->ip;
-	struct env_var *var;
+	struct env_var *vars, *var;
+	char **envp, *str;
+	int n = 2, len;
 
-	clearenv();
-	setenv("PATH", conf.cgi_path, 1);
+	vars = uh_get_process_vars(cl, pi);
 
-	for (var = uh_get_process_vars(cl, pi); var->name; var++) {
+	len = sizeof("PATH=") + strlen(conf.cgi_path);
+	for (var = vars; var->name; var++) {
 		if (!var->value)
 			continue;
 
-		setenv(var->name, var->value, 1);
+		len += strlen(var->name) + strlen(var->value) + 2;
+		n++;
 	}
 
-	if (!chdir(pi->root)) {
-		if (ip)
-			execl(ip->path, ip->path, pi->phys, NULL);
-		else
-			execl(pi->phys, pi->phys, NULL);
+	envp = malloc(n * sizeof(*envp) + len);
+	if (!envp)
+		return NULL;
+
+	str = (char *) &envp[n];
+	n = 0;
+
+	envp[n++] = str;
+	str += sprintf(str, "PATH=%s", conf.cgi_path) + 1;
+
+	for (var = vars; var->name; var++) {
+		if (!var->value)
+			continue;
+
+		envp[n++] = str;
+		str += sprintf(str, "%s=%s", var->name, var->value) + 1;
 	}
 
-	printf("Status: 500 Internal Server Error\r\n\r\n"
-	       "Unable to launch the requested CGI program:\n"
-	       "  %s: %s\n", ip ? ip->path : pi->phys, strerror(errno));
+	envp[n] = NULL;
+
+	return envp;
 }
 
 static void cgi_handle_request(struct client *cl, char *url, struct path_info *pi)
 {
 	unsigned int mode = S_IFREG | S_IXOTH;
+	const struct interpreter *ip = pi->ip;
+	char *argv[3];
+	char **envp;
+	bool ret;
 
-	if (!pi->ip && !((pi->stat.st_mode & mode) == mode)) {
+	if (!ip && !((pi->stat.st_mode & mode) == mode)) {
 		uh_client_error(cl, 403, "Forbidden",
 				"You don't have permission to access %s on this server.",
 				url);
 		return;
 	}
 
-	if (!uh_create_process(cl, pi, url, cgi_main)) {
+	envp = cgi_build_env(cl, pi);
+	if (!envp) {
 		uh_client_error(cl, 500, "Internal Server Error",
 				"Failed to create CGI process: %s", strerror(errno));
 		return;
 	}
 
-	return;
+	argv[0] = (char *) (ip ? ip->path : pi->phys);
+	argv[1] = ip ? (char *) pi->phys : NULL;
+	argv[2] = NULL;
+
+	ret = uh_spawn_process(cl, pi->root, argv, envp);
+	if (!ret)
+		uh_client_error(cl, 500, "Internal Server Error",
+				"Unable to launch the requested CGI program:\n"
+				"  %s: %s\n", argv[0], strerror(errno));
+
+	free(envp);
 }
 
 static bool check_cgi_path(struct path_info *pi, const char *url)
@@ -109,6 +138,7 @@ static bool check_cgi_path(struct path_info *pi, const char *url)
 
 struct dispatch_handler cgi_dispatch = {
 	.script = true,
+	.type = UH_HANDLER_CGI,
 	.check_path = check_cgi_path,
 	.handle_request = cgi_handle_request,
 };
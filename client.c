@@ -17,6 +17,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <libubox/blobmsg.h>
 #include <ctype.h>
 
@@ -25,6 +26,16 @@
 
 static LIST_HEAD(clients);
 static bool client_done = false;
+static struct client *read_client;
+
+/* closed clients are kept for reuse, along with their header and arena buffers */
+static LIST_HEAD(client_pool);
+static int n_pooled;
+
+struct uh_arena_extra {
+	struct uh_arena_extra *next;
+	uint64_t data[];
+};
 
 int n_clients = 0;
 struct config conf = {};
@@ -58,12 +69,14 @@ void uh_http_header(struct client *cl, int code, const char *summary)
 	else
 		conn = "Connection: Keep-Alive";
 
-	ustream_printf(cl->us, "%s %03i %s\r\n%s\r\n%s",
+	uh_response_printf(cl, "%s %03i %s\r\n%s\r\n%s",
 		http_versions[cl->request.version],
 		code, summary, conn, enc);
 
 	if (!r->connection_close)
-		ustream_printf(cl->us, "Keep-Alive: timeout=%d\r\n", conf.http_keepalive);
+		uh_response_printf(cl, "Keep-Alive: timeout=%d\r\n", conf.http_keepalive);
+
+	uh_response_printf(cl, "Date: %s\r\n", uh_http_date());
 }
 
 static void uh_connection_close(struct client *cl)
@@ -73,6 +86,46 @@ static void uh_connection_close(struct client *cl)
 	ustream_state_change(cl->us);
 }
 
+void *uh_arena_alloc(struct client *cl, int len)
+{
+	struct uh_arena_extra *e;
+	void *ptr;
+
+	len = (len + 7) & ~7;
+
+	if (!cl->arena)
+		cl->arena = malloc(UH_ARENA_SIZE);
+
+	if (cl->arena && cl->arena_used + len <= UH_ARENA_SIZE) {
+		ptr = cl->arena + cl->arena_used;
+		cl->arena_used += len;
+		memset(ptr, 0, len);
+		return ptr;
+	}
+
+	/* does not fit, fall back to the heap until the next reset */
+	e = calloc(1, sizeof(*e) + len);
+	if (!e)
+		return NULL;
+
+	e->next = cl->arena_extra;
+	cl->arena_extra = e;
+
+	return e->data;
+}
+
+static void uh_arena_reset(struct client *cl)
+{
+	struct uh_arena_extra *e;
+
+	while ((e = cl->arena_extra) != NULL) {
+		cl->arena_extra = e->next;
+		free(e);
+	}
+
+	cl->arena_used = 0;
+}
+
 static void uh_dispatch_done(struct client *cl)
 {
 	if (cl->dispatch.free)
@@ -84,6 +137,13 @@ static void uh_dispatch_done(struct client *cl)
 static void client_timeout(struct uloop_timeout *timeout)
 {
 	struct client *cl = container_of(timeout, struct client, timeout);
+	int64_t left = (int64_t) (cl->active - uh_metrics_now()) + cl->idle * 1000000LL;
+
+	/* there was activity since the timer was armed, wait for the rest */
+	if (left > 0) {
+		uloop_timeout_set(timeout, (left + 999) / 1000);
+		return;
+	}
 
 	cl->state = CLIENT_STATE_CLOSE;
 	uh_connection_close(cl);
@@ -91,15 +151,38 @@ static void client_timeout(struct uloop_timeout *timeout)
 
 static void uh_set_client_timeout(struct client *cl, int timeout)
 {
+	cl->idle = timeout;
+	cl->active = uh_metrics_now();
 	cl->timeout.cb = client_timeout;
 	uloop_timeout_set(&cl->timeout, timeout * 1000);
 }
 
+/*
+ * Called for every write. Moving the timer each time costs a walk of the
+ * sorted uloop timeout list, so only the time of the activity is noted and
+ * client_timeout() re-arms itself if the client turns out to be busy.
+ */
+void uh_client_touch(struct client *cl)
+{
+	if (cl->timeout.cb != client_timeout) {
+		uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
+		return;
+	}
+
+	if (!cl->timeout.pending || cl->idle != conf.network_timeout) {
+		uh_set_client_timeout(cl, conf.network_timeout);
+		return;
+	}
+
+	cl->active = uh_metrics_now();
+}
+
 static void uh_keepalive_poll_cb(struct uloop_timeout *timeout)
 {
 	struct client *cl = container_of(timeout, struct client, timeout);
 	int sec = cl->requests > 0 ? conf.http_keepalive : conf.network_timeout;
 
+	cl->pipelined = 0;
 	uh_set_client_timeout(cl, sec);
 	cl->us->notify_read(cl->us, 0);
 }
@@ -113,15 +196,37 @@ static void uh_poll_connection(struct client *cl)
 void uh_request_done(struct client *cl)
 {
 	uh_chunk_eof(cl);
+	uh_metrics_request_done(cl);
 	uh_dispatch_done(cl);
 	memset(&cl->dispatch, 0, sizeof(cl->dispatch));
+	uh_arena_reset(cl);
 
 	if (!conf.http_keepalive || cl->request.connection_close)
 		return uh_connection_close(cl);
 
 	cl->state = CLIENT_STATE_INIT;
 	cl->requests++;
-	uh_poll_connection(cl);
+
+	if (!ustream_pending_data(cl->us, false)) {
+		uh_set_client_timeout(cl, conf.http_keepalive);
+		return;
+	}
+
+	/*
+	 * The next request is already buffered: parse it from the running read
+	 * loop, but hand the event loop back every few requests so one pipelining
+	 * client cannot starve the others. Responses finished synchronously make
+	 * the read loop continue on its own, so it checks yield as well.
+	 */
+	if (cl == read_client && ++cl->pipelined < UH_LIMIT_PIPELINE) {
+		uh_set_client_timeout(cl, conf.http_keepalive);
+		cl->pipeline = true;
+		return;
+	}
+
+	cl->yield = true;
+	cl->timeout.cb = uh_keepalive_poll_cb;
+	uloop_timeout_set(&cl->timeout, 0);
 }
 
 void __printf(4, 5)
@@ -130,7 +235,7 @@ uh_client_error(struct client *cl, int code, const char *summary, const char *fm
 	va_list arg;
 
 	uh_http_header(cl, code, summary);
-	ustream_printf(cl->us, "Content-Type: text/html\r\n\r\n");
+	uh_response_printf(cl, "Content-Type: text/html\r\n\r\n");
 
 	uh_chunk_printf(cl, "<h1>%s</h1>", summary);
 
@@ -149,6 +254,60 @@ static void uh_header_error(struct client *cl, int code, const char *summary)
 	uh_connection_close(cl);
 }
 
+/*
+ * The slots are a perfect hash of the header names in enum uh_header,
+ * see uh_header_hash(). Keep both in sync when adding headers.
+ */
+static const struct {
+	const char *name;
+	int idx;
+} header_slots[64] = {
+	[4] = { "connection", UH_HDR_CONNECTION },
+	[7] = { "accept-encoding", UH_HDR_ACCEPT_ENCODING },
+	[12] = { "content-length", UH_HDR_CONTENT_LENGTH },
+	[15] = { "access-control-request-method", UH_HDR_ACCESS_CONTROL_REQUEST_METHOD },
+	[16] = { "accept-charset", UH_HDR_ACCEPT_CHARSET },
+	[20] = { "host", UH_HDR_HOST },
+	[22] = { "access-control-request-headers", UH_HDR_ACCESS_CONTROL_REQUEST_HEADERS },
+	[23] = { "if-none-match", UH_HDR_IF_NONE_MATCH },
+	[24] = { "accept", UH_HDR_ACCEPT },
+	[31] = { "if-unmodified-since", UH_HDR_IF_UNMODIFIED_SINCE },
+	[32] = { "expect", UH_HDR_EXPECT },
+	[35] = { "range", UH_HDR_RANGE },
+	[36] = { "user-agent", UH_HDR_USER_AGENT },
+	[44] = { "if-range", UH_HDR_IF_RANGE },
+	[46] = { "cookie", UH_HDR_COOKIE },
+	[47] = { "transfer-encoding", UH_HDR_TRANSFER_ENCODING },
+	[50] = { "if-match", UH_HDR_IF_MATCH },
+	[51] = { "authorization", UH_HDR_AUTHORIZATION },
+	[53] = { "if-modified-since", UH_HDR_IF_MODIFIED_SINCE },
+	[55] = { "referer", UH_HDR_REFERER },
+	[56] = { "origin", UH_HDR_ORIGIN },
+	[59] = { "accept-language", UH_HDR_ACCEPT_LANGUAGE },
+	[60] = { "content-type", UH_HDR_CONTENT_TYPE },
+};
+
+static inline unsigned int uh_header_hash(const char *name, int len)
+{
+	return (len + (name[0] << 1) + (name[len - 1] << 1) +
+		(name[len / 2] << 3)) & 63;
+}
+
+int uh_header_lookup(const char *name, int len)
+{
+	unsigned int slot;
+
+	/* the hash looks at the last character */
+	if (!len)
+		return -1;
+
+	slot = uh_header_hash(name, len);
+	if (!header_slots[slot].name || strcmp(header_slots[slot].name, name))
+		return -1;
+
+	return header_slots[slot].idx;
+}
+
 static int find_idx(const char * const *list, int max, const char *str)
 {
 	int i;
@@ -160,7 +319,7 @@ static int find_idx(const char * const *list, int max, const char *str)
 	return -1;
 }
 
-static int client_parse_request(struct client *cl, char *data)
+static int client_parse_request(struct client *cl, char *data, int *code)
 {
 	struct http_request *req = &cl->request;
 	char *type, *path, *version;
@@ -175,9 +334,14 @@ static int client_parse_request(struct client *cl, char *data)
 	blobmsg_add_string(&cl->hdr, "URL", path);
 
 	memset(&cl->request, 0, sizeof(cl->request));
+	req->start = uh_metrics_now();
 	h_method = find_idx(http_methods, ARRAY_SIZE(http_methods), type);
 	h_version = find_idx(http_versions, ARRAY_SIZE(http_versions), version);
 	if (h_method < 0 || h_version < 0) {
+		/* includes the HTTP/2 preface "PRI * HTTP/2.0" of h2c clients */
+		if (h_version < 0 && !strncmp(version, "HTTP/", 5))
+			*code = 505;
+
 		req->version = UH_HTTP_VER_1_0;
 		return CLIENT_STATE_DONE;
 	}
@@ -196,6 +360,7 @@ static int client_parse_request(struct client *cl, char *data)
 static bool client_init_cb(struct client *cl, char *buf, int len)
 {
 	char *newline;
+	int code = 400;
 
 	newline = strstr(buf, "\r\n");
 	if (!newline)
@@ -208,10 +373,14 @@ static bool client_init_cb(struct client *cl, char *buf, int len)
 
 	*newline = 0;
 	blob_buf_init(&cl->hdr, 0);
-	cl->state = client_parse_request(cl, buf);
+	cl->state = client_parse_request(cl, buf, &code);
 	ustream_consume(cl->us, newline + 2 - buf);
-	if (cl->state == CLIENT_STATE_DONE)
-		uh_header_error(cl, 400, "Bad Request");
+	if (cl->state == CLIENT_STATE_DONE) {
+		if (code == 505)
+			uh_header_error(cl, 505, "HTTP Version Not Supported");
+		else
+			uh_header_error(cl, 400, "Bad Request");
+	}
 
 	return true;
 }
@@ -232,9 +401,8 @@ static bool rfc1918_filter_check(struct client *cl)
 
 static bool tls_redirect_check(struct client *cl)
 {
-	int rem, port;
-	struct blob_attr *cur;
-	char *ptr, *url = NULL, *host = NULL;
+	int port;
+	char *ptr, *url, *host;
 
 	if (cl->tls || !conf.tls_redirect)
 		return true;
@@ -242,18 +410,9 @@ static bool tls_redirect_check(struct client *cl)
 	if ((port = uh_first_tls_port(cl->srv_addr.family)) == -1)
 		return true;
 
-	blob_for_each_attr(cur, cl->hdr.head, rem) {
-		if (!strcmp(blobmsg_name(cur), "host"))
-			host = blobmsg_get_string(cur);
-
-		if (!strcmp(blobmsg_name(cur), "URL"))
-			url = blobmsg_get_string(cur);
-
-		if (url && host)
-			break;
-	}
-
-	if (!url || !host)
+	url = blobmsg_data(blob_data(cl->hdr.head));
+	host = uh_header(cl, UH_HDR_HOST);
+	if (!host)
 		return true;
 
 	if ((ptr = strchr(host, ']')) != NULL)
@@ -267,9 +426,9 @@ static bool tls_redirect_check(struct client *cl)
 	uh_http_header(cl, 307, "Temporary Redirect");
 
 	if (port != 443)
-		ustream_printf(cl->us, "Location: https://%s:%d%s\r\n\r\n", host, port, url);
+		uh_response_printf(cl, "Location: https://%s:%d%s\r\n\r\n", host, port, url);
 	else
-		ustream_printf(cl->us, "Location: https://%s%s\r\n\r\n", host, url);
+		uh_response_printf(cl, "Location: https://%s%s\r\n\r\n", host, url);
 
 	uh_request_done(cl);
 
@@ -308,9 +467,11 @@ static void client_header_complete(struct client *cl)
 static void client_parse_header(struct client *cl, char *data)
 {
 	struct http_request *r = &cl->request;
+	struct blob_attr *attr;
 	char *err;
 	char *name;
 	char *val;
+	int idx, ofs;
 
 	if (!*data) {
 		uloop_timeout_cancel(&cl->timeout);
@@ -329,26 +490,37 @@ static void client_parse_header(struct client *cl, char *data)
 		if (isupper(*name))
 			*name = tolower(*name);
 
-	if (!strcmp(data, "expect")) {
+	idx = uh_header_lookup(data, name - data);
+
+	switch (idx) {
+	case UH_HDR_EXPECT:
 		if (!strcasecmp(val, "100-continue"))
 			r->expect_cont = true;
 		else {
 			uh_header_error(cl, 412, "Precondition Failed");
 			return;
 		}
-	} else if (!strcmp(data, "content-length")) {
+		break;
+
+	case UH_HDR_CONTENT_LENGTH:
 		r->content_length = strtoul(val, &err, 0);
 		if (err && *err) {
 			uh_header_error(cl, 400, "Bad Request");
 			return;
 		}
-	} else if (!strcmp(data, "transfer-encoding")) {
+		break;
+
+	case UH_HDR_TRANSFER_ENCODING:
 		if (!strcmp(val, "chunked"))
 			r->transfer_chunked = true;
-	} else if (!strcmp(data, "connection")) {
+		break;
+
+	case UH_HDR_CONNECTION:
 		if (!strcasecmp(val, "close"))
 			r->connection_close = true;
-	} else if (!strcmp(data, "user-agent")) {
+		break;
+
+	case UH_HDR_USER_AGENT: {
 		char *str;
 
 		if (strstr(val, "Opera"))
@@ -376,10 +548,17 @@ static void client_parse_header(struct client *cl, char *data)
 			r->ua = UH_UA_GECKO;
 		else if (strstr(val, "Konqueror"))
 			r->ua = UH_UA_KONQUEROR;
+		break;
+	}
 	}
 
-
+	/* remember where the value of known headers ends up */
+	ofs = blob_pad_len(cl->hdr.head);
 	blobmsg_add_string(&cl->hdr, data, val);
+	if (idx >= 0) {
+		attr = (struct blob_attr *) ((char *) cl->hdr.head + ofs);
+		r->hdr[idx] = (char *) blobmsg_data(attr) - (char *) cl->hdr.head;
+	}
 
 	cl->state = CLIENT_STATE_HEADER;
 }
@@ -498,6 +677,8 @@ void uh_client_read_cb(struct client *cl)
 	int len;
 
 	client_done = false;
+	read_client = cl;
+	cl->yield = false;
 	do {
 		str = ustream_get_read_buf(us, &len);
 		if (!str || !len)
@@ -506,13 +687,53 @@ void uh_client_read_cb(struct client *cl)
 		if (cl->state >= array_size(read_cbs) || !read_cbs[cl->state])
 			break;
 
+		cl->pipeline = false;
 		if (!read_cbs[cl->state](cl, str, len)) {
+			if (cl->pipeline)
+				continue;
+
 			if (len == us->r.buffer_len &&
 			    cl->state != CLIENT_STATE_DATA)
 				uh_header_error(cl, 413, "Request Entity Too Large");
 			break;
 		}
-	} while (!client_done);
+	} while (!client_done && !cl->yield);
+	read_client = NULL;
+}
+
+static struct client *uh_client_get(void)
+{
+	struct client *cl;
+	struct blob_buf hdr;
+	char *arena;
+
+	if (list_empty(&client_pool))
+		return calloc(1, sizeof(*cl));
+
+	cl = list_first_entry(&client_pool, struct client, list);
+	list_del(&cl->list);
+	n_pooled--;
+
+	hdr = cl->hdr;
+	arena = cl->arena;
+	memset(cl, 0, sizeof(*cl));
+	cl->hdr = hdr;
+	cl->arena = arena;
+
+	return cl;
+}
+
+static void uh_client_put(struct client *cl)
+{
+	if (n_pooled >= conf.max_connections) {
+		blob_buf_free(&cl->hdr);
+		free(cl->arena);
+		free(cl);
+		return;
+	}
+
+	list_add(&cl->list, &client_pool);
+	n_pooled++;
 }
 
 static void client_close(struct client *cl)
@@ -526,13 +747,14 @@ static void client_close(struct client *cl)
 	n_clients--;
 	uh_dispatch_done(cl);
 	uloop_timeout_cancel(&cl->timeout);
+	uh_response_flush(cl);
 	if (cl->tls)
 		uh_tls_client_detach(cl);
 	ustream_free(&cl->sfd.stream);
 	close(cl->sfd.fd.fd);
 	list_del(&cl->list);
-	blob_buf_free(&cl->hdr);
-	free(cl);
+	uh_arena_reset(cl);
+	uh_client_put(cl);
 
 	uh_unblock_listeners();
 }
@@ -556,6 +778,7 @@ static void client_ustream_read_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, sfd.stream);
 
+	uh_metrics.bytes_in += bytes;
 	uh_client_read_cb(cl);
 }
 
@@ -589,29 +812,38 @@ static void set_addr(struct uh_addr *addr, void *src)
 	}
 }
 
-bool uh_accept_client(int fd, bool tls)
+bool uh_accept_client(int fd, bool tls, void *srv_addr)
 {
-	static struct client *next_client;
 	struct client *cl;
 	unsigned int sl;
 	int sfd;
 	static int client_id = 0;
 	struct sockaddr_in6 addr;
 
-	if (!next_client)
-		next_client = calloc(1, sizeof(*next_client));
-
-	cl = next_client;
+	cl = uh_client_get();
+	if (!cl)
+		return false;
 
 	sl = sizeof(addr);
+#ifdef SOCK_CLOEXEC
+	sfd = accept4(fd, (struct sockaddr *) &addr, &sl, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	sfd = accept(fd, (struct sockaddr *) &addr, &sl);
-	if (sfd < 0)
+#endif
+	if (sfd < 0) {
+		uh_client_put(cl);
 		return false;
+	}
 
 	set_addr(&cl->peer_addr, &addr);
-	sl = sizeof(addr);
-	getsockname(sfd, (struct sockaddr *) &addr, &sl);
-	set_addr(&cl->srv_addr, &addr);
+
+	/* only a wildcard listener leaves the local address open */
+	if (!srv_addr) {
+		sl = sizeof(addr);
+		getsockname(sfd, (struct sockaddr *) &addr, &sl);
+		srv_addr = &addr;
+	}
+	set_addr(&cl->srv_addr, srv_addr);
 
 	cl->us = &cl->sfd.stream;
 	if (tls) {
@@ -628,23 +860,58 @@ bool uh_accept_client(int fd, bool tls)
 	uh_poll_connection(cl);
 	list_add_tail(&cl->list, &clients);
 
-	next_client = NULL;
 	n_clients++;
+	uh_metrics.connections++;
 	cl->id = client_id++;
 	cl->tls = tls;
 
 	return true;
 }
 
-void uh_close_fds(void)
+/*
+ * Collects every descriptor a child process must not inherit. The handler
+ * hooks only report descriptors, this has to run before vfork() since the
+ * child shares our memory and may do nothing but close() them.
+ */
+int *uh_child_fds(int *n)
 {
 	struct client *cl;
+	int *fds, max;
 
-	uloop_done();
-	uh_close_listen_fds();
+	max = uh_listen_fds(NULL);
+	list_for_each_entry(cl, &clients, list)
+		max += 1 + UH_DISPATCH_FDS;
+
+	fds = malloc((max ? max : 1) * sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	*n = uh_listen_fds(fds);
 	list_for_each_entry(cl, &clients, list) {
-		close(cl->sfd.fd.fd);
-		if (cl->dispatch.close_fds)
-			cl->dispatch.close_fds(cl);
+		fds[(*n)++] = cl->sfd.fd.fd;
+		if (cl->dispatch.child_fds)
+			*n += cl->dispatch.child_fds(cl, fds + *n);
 	}
+
+	return fds;
+}
+
+void uh_close_client_fds(void)
+{
+	int *fds, i, n;
+
+	fds = uh_child_fds(&n);
+	if (!fds)
+		return;
+
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+
+	free(fds);
+}
+
+void uh_close_fds(void)
+{
+	uloop_done();
+	uh_close_client_fds();
 }
@@ -0,0 +1,766 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <strings.h>
+#include <libubox/usock.h>
+#include <libubox/blobmsg.h>
+#include "uhttpd.h"
+
+#define FCGI_VERSION_1		1
+#define FCGI_BEGIN_REQUEST	1
+#define FCGI_END_REQUEST	3
+#define FCGI_PARAMS		4
+#define FCGI_STDIN		5
+#define FCGI_STDOUT		6
+
+#define FCGI_RESPONDER		1
+#define FCGI_KEEP_CONN		1
+
+#define FCGI_REQUEST_ID		1
+#define FCGI_RECORD_MAX		0xffff
+
+#define UH_FCGI_MAX_IDLE	4
+#define UH_FCGI_WRITE_LIMIT	(64 * 1024)
+#define UH_FCGI_HEADER_SIZE	4096
+
+struct fcgi_header {
+	uint8_t version;
+	uint8_t type;
+	uint16_t id;
+	uint16_t len;
+	uint8_t padding;
+	uint8_t reserved;
+};
+
+struct fcgi_upstream {
+	struct list_head list;
+	struct list_head idle;
+	int n_idle;
+
+	const char *prefix;
+	const char *host;
+	const char *port;
+	bool scgi;
+};
+
+struct fcgi_conn {
+	struct list_head list;
+	struct ustream_fd sfd;
+	struct uloop_timeout close;
+	struct fcgi_upstream *up;
+	struct client *cl;
+	bool keep;
+	bool idle;
+
+	struct fcgi_header rec;
+	int rec_fill;
+	int rec_len;
+	int rec_pad;
+	bool in_rec;
+};
+
+struct fcgi_stream {
+	struct ustream *s;
+	int type;
+	int len;
+	char data[1024];
+};
+
+static LIST_HEAD(upstreams);
+
+static const char *fcgi_var(struct env_var *vars, const char *name)
+{
+	for (; vars->name; vars++)
+		if (!strcmp(vars->name, name))
+			return vars->value;
+
+	return NULL;
+}
+
+static void fcgi_write_record(struct ustream *s, int type, const char *data, int len)
+{
+	static const char padding[8];
+	struct fcgi_header hdr = {
+		.version = FCGI_VERSION_1,
+		.type = type,
+		.id = htons(FCGI_REQUEST_ID),
+	};
+	int cur_len;
+
+	do {
+		cur_len = min(len, FCGI_RECORD_MAX);
+		hdr.len = htons(cur_len);
+		hdr.padding = -cur_len & 7;
+
+		ustream_write(s, (char *) &hdr, sizeof(hdr), true);
+		if (cur_len)
+			ustream_write(s, data, cur_len, true);
+		if (hdr.padding)
+			ustream_write(s, padding, hdr.padding, true);
+
+		data += cur_len;
+		len -= cur_len;
+	} while (len);
+}
+
+static void fcgi_stream_flush(struct fcgi_stream *fs)
+{
+	if (!fs->len)
+		return;
+
+	fcgi_write_record(fs->s, fs->type, fs->data, fs->len);
+	fs->len = 0;
+}
+
+static void fcgi_stream_add(struct fcgi_stream *fs, const void *data, int len)
+{
+	int cur_len;
+
+	while (len) {
+		cur_len = min(len, sizeof(fs->data) - fs->len);
+		memcpy(fs->data + fs->len, data, cur_len);
+		fs->len += cur_len;
+		data += cur_len;
+		len -= cur_len;
+
+		if (fs->len == sizeof(fs->data))
+			fcgi_stream_flush(fs);
+	}
+}
+
+static void fcgi_stream_len(struct fcgi_stream *fs, uint32_t len)
+{
+	uint8_t buf[4];
+
+	if (len < 0x80) {
+		buf[0] = len;
+		fcgi_stream_add(fs, buf, 1);
+		return;
+	}
+
+	buf[0] = (len >> 24) | 0x80;
+	buf[1] = len >> 16;
+	buf[2] = len >> 8;
+	buf[3] = len;
+	fcgi_stream_add(fs, buf, 4);
+}
+
+static void fcgi_send_params(struct ustream *s, struct env_var *vars)
+{
+	struct {
+		struct fcgi_header hdr;
+		uint16_t role;
+		uint8_t flags;
+		uint8_t reserved[5];
+	} begin = {
+		.hdr = {
+			.version = FCGI_VERSION_1,
+			.type = FCGI_BEGIN_REQUEST,
+			.id = htons(FCGI_REQUEST_ID),
+			.len = htons(8),
+		},
+		.role = htons(FCGI_RESPONDER),
+		.flags = FCGI_KEEP_CONN,
+	};
+	static struct fcgi_stream fs;
+	int name_len, value_len;
+
+	ustream_write(s, (char *) &begin, sizeof(begin), true);
+
+	fs.s = s;
+	fs.type = FCGI_PARAMS;
+	fs.len = 0;
+
+	for (; vars->name; vars++) {
+		if (!vars->value)
+			continue;
+
+		name_len = strlen(vars->name);
+		value_len = strlen(vars->value);
+		fcgi_stream_len(&fs, name_len);
+		fcgi_stream_len(&fs, value_len);
+		fcgi_stream_add(&fs, vars->name, name_len);
+		fcgi_stream_add(&fs, vars->value, value_len);
+	}
+
+	fcgi_stream_flush(&fs);
+	fcgi_write_record(s, FCGI_PARAMS, NULL, 0);
+}
+
+static void scgi_send_params(struct ustream *s, struct env_var *vars)
+{
+	const char *clen = fcgi_var(vars, "CONTENT_LENGTH");
+	struct env_var *var;
+	int len;
+
+	if (!clen || !*clen)
+		clen = "0";
+
+	/* CONTENT_LENGTH has to come first */
+	len = sizeof("CONTENT_LENGTH") + strlen(clen) + 1 + sizeof("SCGI") + 2;
+	for (var = vars; var->name; var++) {
+		if (!var->value || !strcmp(var->name, "CONTENT_LENGTH"))
+			continue;
+
+		len += strlen(var->name) + strlen(var->value) + 2;
+	}
+
+	ustream_printf(s, "%d:CONTENT_LENGTH%c%s%cSCGI%c1%c",
+		       len, 0, clen, 0, 0, 0);
+
+	for (var = vars; var->name; var++) {
+		if (!var->value || !strcmp(var->name, "CONTENT_LENGTH"))
+			continue;
+
+		ustream_write(s, var->name, strlen(var->name) + 1, true);
+		ustream_write(s, var->value, strlen(var->value) + 1, true);
+	}
+
+	ustream_write(s, ",", 1, false);
+}
+
+static void fcgi_conn_free_cb(struct uloop_timeout *t)
+{
+	struct fcgi_conn *c = container_of(t, struct fcgi_conn, close);
+
+	ustream_free(&c->sfd.stream);
+	close(c->sfd.fd.fd);
+	free(c);
+}
+
+/* freed from a timer, as this is usually reached from stream callbacks */
+static void fcgi_conn_close(struct fcgi_conn *c)
+{
+	if (c->idle) {
+		list_del(&c->list);
+		c->up->n_idle--;
+		c->idle = false;
+	}
+
+	c->cl = NULL;
+	c->sfd.stream.notify_read = NULL;
+	c->sfd.stream.notify_write = NULL;
+	c->sfd.stream.notify_state = NULL;
+	ustream_set_read_blocked(&c->sfd.stream, true);
+
+	c->close.cb = fcgi_conn_free_cb;
+	uloop_timeout_set(&c->close, 1);
+}
+
+static void fcgi_conn_release(struct fcgi_conn *c)
+{
+	struct fcgi_upstream *up = c->up;
+	struct ustream *s = &c->sfd.stream;
+
+	if (!c->keep || up->scgi || up->n_idle >= UH_FCGI_MAX_IDLE ||
+	    s->eof || s->write_error || ustream_pending_data(s, false)) {
+		fcgi_conn_close(c);
+		return;
+	}
+
+	c->cl = NULL;
+	c->idle = true;
+	ustream_set_read_blocked(s, false);
+	list_add(&c->list, &up->idle);
+	up->n_idle++;
+}
+
+static void fcgi_finish(struct fcgi_conn *c, bool keep)
+{
+	struct client *cl = c->cl;
+	struct dispatch_fcgi *f = &cl->dispatch.fcgi;
+
+	c->keep = keep && f->data_done;
+
+	if (!f->header_done) {
+		uh_client_error(cl, 502, "Bad Gateway",
+				"The upstream server did not produce a valid response");
+		return;
+	}
+
+	uh_request_done(cl);
+}
+
+static bool fcgi_parse_header(struct client *cl, char *line)
+{
+	static char status_buf[64];
+	struct dispatch_fcgi *f = &cl->dispatch.fcgi;
+	char *val, *sep;
+
+	val = uh_split_header(line);
+	if (!val)
+		return false;
+
+	if (!strcmp(line, "Status")) {
+		sep = strchr(val, ' ');
+		if (sep != val + 3)
+			return true;
+
+		snprintf(status_buf, sizeof(status_buf), "%s", sep + 1);
+		f->status_msg = status_buf;
+		f->status_code = atoi(val);
+		return true;
+	}
+
+	/* already sent by uh_http_header() */
+	if (!strcasecmp(line, "Date"))
+		return true;
+
+	blobmsg_add_string(&f->hdr, line, val);
+	return true;
+}
+
+static void fcgi_header_end(struct client *cl)
+{
+	struct dispatch_fcgi *f = &cl->dispatch.fcgi;
+	struct blob_attr *cur;
+	int rem;
+
+	f->header_done = true;
+	uloop_timeout_cancel(&f->timeout);
+
+	uh_http_header(cl, f->status_code, f->status_msg);
+	blob_for_each_attr(cur, f->hdr.head, rem)
+		uh_response_printf(cl, "%s: %s\r\n", blobmsg_name(cur), blobmsg_get_string(cur));
+
+	uh_response_printf(cl, "\r\n");
+	uh_response_flush(cl);
+}
+
+/* Feeds CGI style response data, returns false once the request is gone */
+static bool fcgi_response(struct client *cl, const char *data, int len)
+{
+	struct dispatch_fcgi *f = &cl->dispatch.fcgi;
+	char *line, *newline;
+	int cur_len;
+
+	while (!f->header_done && len) {
+		cur_len = min(len, UH_FCGI_HEADER_SIZE - 1 - f->hdr_len);
+		memcpy(f->hdr_buf + f->hdr_len, data, cur_len);
+		f->hdr_len += cur_len;
+		f->hdr_buf[f->hdr_len] = 0;
+		data += cur_len;
+		len -= cur_len;
+
+		line = f->hdr_buf;
+		while ((newline = strchr(line, '\n')) != NULL) {
+			char *next = newline + 1;
+
+			if (newline > line && newline[-1] == '\r')
+				newline--;
+
+			*newline = 0;
+			if (newline == line) {
+				/* hand back whatever followed the header */
+				data -= f->hdr_buf + f->hdr_len - next;
+				len += f->hdr_buf + f->hdr_len - next;
+				fcgi_header_end(cl);
+				break;
+			}
+
+			if (!fcgi_parse_header(cl, line))
+				goto error;
+
+			line = next;
+		}
+
+		if (f->header_done)
+			break;
+
+		f->hdr_len -= line - f->hdr_buf;
+		memmove(f->hdr_buf, line, f->hdr_len);
+		if (f->hdr_len == UH_FCGI_HEADER_SIZE - 1)
+			goto error;
+	}
+
+	if (len && cl->request.method != UH_HTTP_MSG_HEAD)
+		uh_chunk_write(cl, data, len);
+
+	return true;
+
+error:
+	f->conn->keep = false;
+	uh_client_error(cl, 502, "Bad Gateway",
+			"The upstream server sent a malformed response header");
+	return false;
+}
+
+static void fcgi_read_cb(struct ustream *s, int bytes)
+{
+	struct fcgi_conn *c = container_of(s, struct fcgi_conn, sfd.stream);
+	struct client *cl = c->cl;
+	char *buf;
+	int len, cur_len;
+
+	while (1) {
+		/* nothing is expected while idle */
+		if (!cl) {
+			fcgi_conn_close(c);
+			return;
+		}
+
+		if (c->in_rec && !c->rec_len && !c->rec_pad) {
+			c->in_rec = false;
+			if (c->rec.type == FCGI_END_REQUEST) {
+				fcgi_finish(c, true);
+				return;
+			}
+			continue;
+		}
+
+		if (ustream_pending_data(cl->us, true)) {
+			ustream_set_read_blocked(s, true);
+			return;
+		}
+
+		buf = ustream_get_read_buf(s, &len);
+		if (!buf || !len)
+			break;
+
+		if (c->up->scgi) {
+			if (!fcgi_response(cl, buf, len))
+				return;
+			ustream_consume(s, len);
+			continue;
+		}
+
+		if (!c->in_rec) {
+			cur_len = min(len, sizeof(c->rec) - c->rec_fill);
+			memcpy((char *) &c->rec + c->rec_fill, buf, cur_len);
+			ustream_consume(s, cur_len);
+
+			c->rec_fill += cur_len;
+			if (c->rec_fill < sizeof(c->rec))
+				continue;
+
+			if (c->rec.version != FCGI_VERSION_1 ||
+			    ntohs(c->rec.id) != FCGI_REQUEST_ID) {
+				fcgi_finish(c, false);
+				return;
+			}
+
+			c->rec_fill = 0;
+			c->rec_len = ntohs(c->rec.len);
+			c->rec_pad = c->rec.padding;
+			c->in_rec = true;
+			continue;
+		}
+
+		if (c->rec_len) {
+			cur_len = min(len, c->rec_len);
+
+			/* stderr and the end request body are dropped */
+			if (c->rec.type == FCGI_STDOUT &&
+			    !fcgi_response(cl, buf, cur_len))
+				return;
+
+			c->rec_len -= cur_len;
+			ustream_consume(s, cur_len);
+			continue;
+		}
+
+		cur_len = min(len, c->rec_pad);
+		c->rec_pad -= cur_len;
+		ustream_consume(s, cur_len);
+	}
+
+	if (s->write_error || (s->eof && !ustream_pending_data(s, false)))
+		fcgi_finish(c, false);
+}
+
+static void fcgi_write_cb(struct ustream *s, int bytes)
+{
+	struct fcgi_conn *c = container_of(s, struct fcgi_conn, sfd.stream);
+	struct client *cl = c->cl;
+
+	if (!cl || !cl->dispatch.data_blocked)
+		return;
+
+	if (ustream_pending_data(s, true) >= UH_FCGI_WRITE_LIMIT)
+		return;
+
+	cl->dispatch.data_blocked = false;
+	client_poll_post_data(cl);
+}
+
+static void fcgi_state_cb(struct ustream *s)
+{
+	struct fcgi_conn *c = container_of(s, struct fcgi_conn, sfd.stream);
+
+	if (!s->eof && !s->write_error)
+		return;
+
+	if (!c->cl) {
+		fcgi_conn_close(c);
+		return;
+	}
+
+	if (!ustream_read_blocked(s))
+		fcgi_read_cb(s, 0);
+}
+
+static struct fcgi_conn *fcgi_conn_get(struct fcgi_upstream *up)
+{
+	struct fcgi_conn *c;
+	int fd;
+
+	if (!list_empty(&up->idle)) {
+		c = list_first_entry(&up->idle, struct fcgi_conn, list);
+		list_del(&c->list);
+		up->n_idle--;
+		c->idle = false;
+		return c;
+	}
+
+	if (up->port)
+		fd = usock(USOCK_TCP | USOCK_NONBLOCK | USOCK_NUMERIC, up->host, up->port);
+	else
+		fd = usock(USOCK_UNIX | USOCK_NONBLOCK, up->host, NULL);
+
+	if (fd < 0)
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(fd);
+		return NULL;
+	}
+
+	fd_cloexec(fd);
+
+	c->up = up;
+	c->sfd.stream.notify_read = fcgi_read_cb;
+	c->sfd.stream.notify_write = fcgi_write_cb;
+	c->sfd.stream.notify_state = fcgi_state_cb;
+	ustream_fd_init(&c->sfd, fd);
+
+	return c;
+}
+
+static int fcgi_data_send(struct client *cl, const char *data, int len)
+{
+	struct fcgi_conn *c = cl->dispatch.fcgi.conn;
+	struct ustream *s = &c->sfd.stream;
+
+	if (c->up->scgi)
+		ustream_write(s, data, len, false);
+	else
+		fcgi_write_record(s, FCGI_STDIN, data, len);
+
+	if (ustream_pending_data(s, true) >= UH_FCGI_WRITE_LIMIT)
+		cl->dispatch.data_blocked = true;
+
+	return len;
+}
+
+static void fcgi_data_done(struct client *cl)
+{
+	struct dispatch_fcgi *f = &cl->dispatch.fcgi;
+
+	if (f->data_done)
+		return;
+
+	f->data_done = true;
+	if (!f->conn->up->scgi)
+		fcgi_write_record(&f->conn->sfd.stream, FCGI_STDIN, NULL, 0);
+}
+
+static void fcgi_client_write_cb(struct client *cl)
+{
+	struct fcgi_conn *c = cl->dispatch.fcgi.conn;
+	struct ustream *s = &c->sfd.stream;
+
+	if (ustream_pending_data(cl->us, true))
+		return;
+
+	ustream_set_read_blocked(s, false);
+	s->notify_read(s, 0);
+}
+
+static int fcgi_child_fds(struct client *cl, int *fds)
+{
+	fds[0] = cl->dispatch.fcgi.conn->sfd.fd.fd;
+	return 1;
+}
+
+static void fcgi_free(struct client *cl)
+{
+	struct dispatch_fcgi *f = &cl->dispatch.fcgi;
+
+	uloop_timeout_cancel(&f->timeout);
+	blob_buf_free(&f->hdr);
+	free(f->hdr_buf);
+
+	if (f->conn)
+		fcgi_conn_release(f->conn);
+}
+
+static void fcgi_timeout_cb(struct uloop_timeout *timeout)
+{
+	struct dispatch_fcgi *f = container_of(timeout, struct dispatch_fcgi, timeout);
+	struct client *cl = container_of(f, struct client, dispatch.fcgi);
+
+	f->conn->keep = false;
+	uh_client_error(cl, 504, "Gateway Timeout",
+			"The upstream server did not respond in time");
+}
+
+static struct fcgi_upstream *fcgi_upstream_find(const char *url)
+{
+	struct fcgi_upstream *up;
+
+	list_for_each_entry(up, &upstreams, list)
+		if (uh_path_match(up->prefix, url))
+			return up;
+
+	return NULL;
+}
+
+static void fcgi_handle_request(struct client *cl, char *url, struct path_info *pi)
+{
+	struct dispatch *d = &cl->dispatch;
+	struct dispatch_fcgi *f = &d->fcgi;
+	struct fcgi_upstream *up = fcgi_upstream_find(url);
+	struct path_info _pi = {};
+	struct env_var *vars;
+	struct fcgi_conn *c;
+	int path_len, prefix_len;
+	char *info, *query;
+
+	f->hdr_buf = malloc(UH_FCGI_HEADER_SIZE);
+	c = f->hdr_buf ? fcgi_conn_get(up) : NULL;
+	if (!c) {
+		free(f->hdr_buf);
+		f->hdr_buf = NULL;
+		uh_client_error(cl, 502, "Bad Gateway",
+				"Unable to connect to the upstream server: %s",
+				strerror(errno));
+		return;
+	}
+
+	c->cl = cl;
+	c->keep = false;
+	f->conn = c;
+	f->status_code = 200;
+	f->status_msg = "OK";
+	blob_buf_init(&f->hdr, 0);
+
+	d->free = fcgi_free;
+	d->child_fds = fcgi_child_fds;
+	d->data_send = fcgi_data_send;
+	d->data_done = fcgi_data_done;
+	d->write_cb = fcgi_client_write_cb;
+
+	f->timeout.cb = fcgi_timeout_cb;
+	if (conf.script_timeout > 0)
+		uloop_timeout_set(&f->timeout, conf.script_timeout * 1000);
+
+	prefix_len = strlen(up->prefix);
+	path_len = strlen(url);
+	query = strchr(url, '?');
+	if (query) {
+		if (query[1])
+			_pi.query = query + 1;
+		path_len = query - url;
+	}
+
+	if (path_len > prefix_len) {
+		info = alloca(path_len - prefix_len + 1);
+		memcpy(info, url + prefix_len, path_len - prefix_len);
+		info[path_len - prefix_len] = 0;
+		_pi.info = info;
+	}
+
+	_pi.name = up->prefix;
+	_pi.root = conf.docroot;
+
+	vars = uh_get_process_vars(cl, &_pi);
+	if (up->scgi)
+		scgi_send_params(&c->sfd.stream, vars);
+	else
+		fcgi_send_params(&c->sfd.stream, vars);
+}
+
+static bool fcgi_check_url(const char *url)
+{
+	return fcgi_upstream_find(url) != NULL;
+}
+
+static struct dispatch_handler fcgi_dispatch = {
+	.type = UH_HANDLER_FCGI,
+	.script = true,
+	.check_url = fcgi_check_url,
+	.handle_request = fcgi_handle_request,
+};
+
+/*
+ * Maps prefix to a FastCGI (or with "scgi:" SCGI) backend, given either
+ * as absolute unix socket path or as numeric host:port. FastCGI backend
+ * connections are kept open and reused, one request at a time.
+ */
+int uh_fcgi_add(const char *prefix, const char *addr)
+{
+	struct fcgi_upstream *up;
+	char *host, *port = NULL;
+	bool scgi = false;
+
+	if (!strncmp(addr, "scgi:", 5)) {
+		scgi = true;
+		addr += 5;
+	} else if (!strncmp(addr, "fcgi:", 5)) {
+		addr += 5;
+	}
+
+	host = strdup(addr);
+	if (!host)
+		return -1;
+
+	if (*host != '/') {
+		port = strrchr(host, ':');
+		if (!port || port == host) {
+			free(host);
+			return -1;
+		}
+
+		*port++ = 0;
+
+		if (*host == '[' && port[-2] == ']') {
+			port[-2] = 0;
+			host++;
+		}
+	}
+
+	up = calloc(1, sizeof(*up));
+	if (!up)
+		return -1;
+
+	up->prefix = prefix;
+	up->host = host;
+	up->port = port;
+	up->scgi = scgi;
+	INIT_LIST_HEAD(&up->idle);
+
+	if (list_empty(&upstreams))
+		uh_dispatch_add(&fcgi_dispatch);
+
+	list_add_tail(&up->list, &upstreams);
+
+	return 0;
+}
@@ -27,22 +27,49 @@
 #include <strings.h>
 #include <dirent.h>
 #include <stdint.h>
+#include <ctype.h>
+#ifdef linux
+#include <sys/sendfile.h>
+#endif
 
 #include <libubox/blobmsg.h>
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
 
 #include "uhttpd.h"
 #include "mimetypes.h"
 
+#define UH_SENDFILE_CHUNK	(64 * 1024)
+#define UH_PATH_CACHE_SIZE	128
+#define UH_DIRLIST_CACHE_SIZE	8
+#define UH_DIRLIST_CACHE_MAX	(256 * 1024)
+
+#define UH_RANGE_PART_FMT \
+	"\r\n--%s\r\nContent-Type: %s\r\n" \
+	"Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n\r\n"
+
 static LIST_HEAD(index_files);
 static LIST_HEAD(dispatch_handlers);
-static LIST_HEAD(pending_requests);
+/* queued script requests, FIFO per class, Lua ahead of CGI and FastCGI */
+enum script_class {
+	SCRIPT_CLASS_API,
+	SCRIPT_CLASS_BULK,
+	__SCRIPT_CLASS_MAX
+};
+
+static struct list_head pending_requests[__SCRIPT_CLASS_MAX] = {
+	LIST_HEAD_INIT(pending_requests[SCRIPT_CLASS_API]),
+	LIST_HEAD_INIT(pending_requests[SCRIPT_CLASS_BULK]),
+};
 static int n_requests;
+static int n_queued;
 
 struct deferred_request {
 	struct list_head list;
 	struct dispatch_handler *d;
 	struct client *cl;
 	struct path_info pi;
+	uint64_t expires;
 	bool called, path;
 };
 
@@ -51,16 +78,77 @@ struct index_file {
 	const char *name;
 };
 
-enum file_hdr {
-	HDR_AUTHORIZATION,
-	HDR_IF_MODIFIED_SINCE,
-	HDR_IF_UNMODIFIED_SINCE,
-	HDR_IF_MATCH,
-	HDR_IF_NONE_MATCH,
-	HDR_IF_RANGE,
-	__HDR_MAX
+struct path_cache_entry {
+	time_t expires;
+	const char *url;
+	int url_len;
+	const char *phys;
+	const char *info;
+	struct stat stat;
+};
+
+static struct path_cache_entry *path_cache[UH_PATH_CACHE_SIZE];
+
+/* rendered directory listings, keyed on path and format */
+struct dirlist_cache_entry {
+	time_t expires;
+	const char *phys;
+	const char *name;
+	bool json;
+	ino_t ino;
+	time_t mtime;
+	char tag[24];
+	char *body;
+	int len;
+};
+
+static struct dirlist_cache_entry *dirlist_cache[UH_DIRLIST_CACHE_SIZE];
+
+static const struct {
+	const char *name;
+	const char *ext;
+} encodings[] = {
+	{ "br", ".br" },
+	{ "gzip", ".gz" },
+};
+
+/* one variant per precompressed encoding, the last one is the file itself */
+#define UH_FILE_VARIANTS	(ARRAY_SIZE(encodings) + 1)
+
+enum file_variant_state {
+	VARIANT_UNKNOWN,
+	VARIANT_ABSENT,
+	VARIANT_PRESENT,
+};
+
+/* hot files kept in memory, body preceded by the response headers */
+struct file_cache_variant {
+	enum file_variant_state state;
+	time_t checked;
+	struct stat stat;
+	char *data;
+	int hdr_len;
+	int len;
 };
 
+struct file_cache_entry {
+	struct avl_node avl;
+	struct list_head list;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	struct file_cache_variant var[UH_FILE_VARIANTS];
+};
+
+static AVL_TREE(file_cache, avl_strcmp, false, NULL);
+static LIST_HEAD(file_cache_lru);
+static int file_cache_used;
+
+static struct mimetype *mime_extra;
+static int n_mime_extra;
+static struct mimetype *mime_types;
+static int n_mime_types;
+
 void uh_index_add(const char *filename)
 {
 	struct index_file *idx;
@@ -70,6 +158,71 @@ void uh_index_add(const char *filename)
 	list_add_tail(&idx->list, &index_files);
 }
 
+void uh_mime_add(const char *ext, const char *mime)
+{
+	struct mimetype *m;
+
+	if (*ext == '.')
+		ext++;
+
+	if (!*ext || !*mime)
+		return;
+
+	m = realloc(mime_extra, (n_mime_extra + 1) * sizeof(*m));
+	if (!m)
+		return;
+
+	mime_extra = m;
+	mime_extra[n_mime_extra].extn = ext;
+	mime_extra[n_mime_extra].mime = mime;
+	n_mime_extra++;
+}
+
+static int mimetype_cmp(const void *a, const void *b)
+{
+	const struct mimetype *ma = a, *mb = b;
+	int ret = strcasecmp(ma->extn, mb->extn);
+
+	/* keep the original order of duplicates, the first one wins */
+	if (!ret)
+		ret = (ma > mb) - (ma < mb);
+
+	return ret;
+}
+
+static int mimetype_find_cmp(const void *key, const void *m)
+{
+	return strcasecmp(key, ((const struct mimetype *) m)->extn);
+}
+
+/* Builds a single case-insensitively sorted table from the extensions
+** added through uh_mime_add(), which take precedence, and the built-in
+** list in mimetypes.h. */
+static void uh_mime_init(void)
+{
+	int n_builtin = ARRAY_SIZE(uh_mime_types) - 1;
+	int i, n = 0;
+
+	mime_types = calloc(n_mime_extra + n_builtin, sizeof(*mime_types));
+	if (!mime_types)
+		return;
+
+	if (n_mime_extra)
+		memcpy(mime_types, mime_extra, n_mime_extra * sizeof(*mime_types));
+
+	memcpy(&mime_types[n_mime_extra], uh_mime_types, n_builtin * sizeof(*mime_types));
+	qsort(mime_types, n_mime_extra + n_builtin, sizeof(*mime_types), mimetype_cmp);
+
+	for (i = 0; i < n_mime_extra + n_builtin; i++) {
+		if (n && !strcasecmp(mime_types[n - 1].extn, mime_types[i].extn))
+			continue;
+
+		mime_types[n++] = mime_types[i];
+	}
+
+	n_mime_types = n;
+}
+
 static char * canonpath(const char *path, char *path_resolved)
 {
 	const char *path_cpy = path;
@@ -122,6 +275,93 @@ next:
 	return path_resolved;
 }
 
+static time_t uh_path_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static struct path_cache_entry **uh_path_cache_slot(const char *url, int len)
+{
+	unsigned int hash = 5381;
+	int i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash * 33) ^ (unsigned char) url[i];
+
+	return &path_cache[hash % UH_PATH_CACHE_SIZE];
+}
+
+static struct path_cache_entry *uh_path_cache_get(const char *url, int len)
+{
+	struct path_cache_entry **slot, *e;
+
+	if (conf.path_cache_ttl <= 0)
+		return NULL;
+
+	slot = uh_path_cache_slot(url, len);
+	e = *slot;
+
+	if (!e || e->url_len != len || memcmp(e->url, url, len))
+		return NULL;
+
+	if (uh_path_cache_now() >= e->expires) {
+		free(e);
+		*slot = NULL;
+		return NULL;
+	}
+
+	return e;
+}
+
+static void uh_path_cache_add(const char *url, int len, struct path_info *pi)
+{
+	struct path_cache_entry **slot, *e;
+	char *_url, *_phys, *_info;
+
+	if (conf.path_cache_ttl <= 0)
+		return;
+
+	e = calloc_a(sizeof(*e),
+		&_url, len + 1,
+		&_phys, strlen(pi->phys) + 1,
+		&_info, pi->info ? strlen(pi->info) + 1 : 0);
+
+	if (!e)
+		return;
+
+	memcpy(_url, url, len);
+	e->url = _url;
+	e->url_len = len;
+	e->phys = strcpy(_phys, pi->phys);
+	e->info = pi->info ? strcpy(_info, pi->info) : NULL;
+	memcpy(&e->stat, &pi->stat, sizeof(e->stat));
+	e->expires = uh_path_cache_now() + conf.path_cache_ttl;
+
+	/* direct mapped, a colliding url simply evicts the previous entry */
+	slot = uh_path_cache_slot(url, len);
+	free(*slot);
+	*slot = e;
+}
+
+static void uh_path_cache_drop(const char *url)
+{
+	struct path_cache_entry **slot, *e;
+	int len = strcspn(url, "?");
+
+	slot = uh_path_cache_slot(url, len);
+	e = *slot;
+
+	if (!e || e->url_len != len || memcmp(e->url, url, len))
+		return;
+
+	free(e);
+	*slot = NULL;
+}
+
 /* Returns NULL on error.
 ** NB: improperly encoded URL should give client 400 [Bad Syntax]; returning
 ** NULL here causes 404 [Not Found], but that's not too unreasonable. */
@@ -138,9 +378,10 @@ uh_path_lookup(struct client *cl, const char *url)
 	bool slash;
 
 	int i = 0;
-	int len;
+	int len, url_len;
 	struct stat s;
 	struct index_file *idx;
+	struct path_cache_entry *ce;
 
 	/* back out early if url is undefined */
 	if (url == NULL)
@@ -150,25 +391,33 @@ uh_path_lookup(struct client *cl, const char *url)
 	path_phys[0] = 0;
 	path_info[0] = 0;
 
-	strcpy(uh_buf, docroot);
-
 	/* separate query string from url */
-	if ((pathptr = strchr(url, '?')) != NULL) {
+	pathptr = strchr(url, '?');
+	url_len = pathptr ? pathptr - url : strlen(url);
+	if (pathptr)
 		p.query = pathptr[1] ? pathptr + 1 : NULL;
 
-		/* urldecode component w/o query */
-		if (pathptr > url) {
-			if (uh_urldecode(&uh_buf[docroot_len],
-					 sizeof(uh_buf) - docroot_len - 1,
-					 url, pathptr - url ) < 0)
-				return NULL;
-		}
+	ce = uh_path_cache_get(url, url_len);
+	if (ce) {
+		strcpy(path_phys, ce->phys);
+		if (ce->info)
+			strcpy(path_info, ce->info);
+
+		memcpy(&p.stat, &ce->stat, sizeof(p.stat));
+		p.root = docroot;
+		p.phys = path_phys;
+		p.name = &path_phys[docroot_len];
+		p.info = ce->info ? path_info : NULL;
+		return &p;
 	}
 
-	/* no query string, decode all of url */
-	else if (uh_urldecode(&uh_buf[docroot_len],
-			      sizeof(uh_buf) - docroot_len - 1,
-			      url, strlen(url) ) < 0)
+	strcpy(uh_buf, docroot);
+
+	/* urldecode component w/o query */
+	if (url_len > 0 &&
+	    uh_urldecode(&uh_buf[docroot_len],
+			 sizeof(uh_buf) - docroot_len - 1,
+			 url, url_len) < 0)
 		return NULL;
 
 	/* create canon path */
@@ -210,6 +459,7 @@ uh_path_lookup(struct client *cl, const char *url)
 		p.phys = path_phys;
 		p.name = &path_phys[docroot_len];
 		p.info = path_info[0] ? path_info : NULL;
+		uh_path_cache_add(url, url_len, &p);
 		return &p;
 	}
 
@@ -233,8 +483,8 @@ uh_path_lookup(struct client *cl, const char *url)
 	   url with trailing slash appended */
 	if (!slash) {
 		uh_http_header(cl, 302, "Found");
-		ustream_printf(cl->us, "Content-Length: 0\r\n");
-		ustream_printf(cl->us, "Location: %s%s%s\r\n\r\n",
+		uh_response_printf(cl, "Content-Length: 0\r\n");
+		uh_response_printf(cl, "Location: %s%s%s\r\n\r\n",
 				&path_phys[docroot_len],
 				p.query ? "?" : "",
 				p.query ? p.query : "");
@@ -261,26 +511,33 @@ uh_path_lookup(struct client *cl, const char *url)
 	p.root = docroot;
 	p.phys = path_phys;
 	p.name = &path_phys[docroot_len];
+	uh_path_cache_add(url, url_len, &p);
 
 	return p.phys ? &p : NULL;
 }
 
-static const char * uh_file_mime_lookup(const char *path)
+const char *uh_file_mime_lookup(const char *path)
 {
-	const struct mimetype *m = &uh_mime_types[0];
+	const struct mimetype *m;
 	const char *e;
 
-	while (m->extn) {
-		e = &path[strlen(path)-1];
+	if (!mime_types)
+		uh_mime_init();
 
-		while (e >= path) {
-			if ((*e == '.' || *e == '/') && !strcasecmp(&e[1], m->extn))
-				return m->mime;
+	e = strrchr(path, '/');
+	if (!e)
+		e = path;
 
-			e--;
-		}
+	/* try the longest suffix of the file name first, so that multi part
+	   extensions like tar.gz take precedence over gz */
+	for (; e; e = strchr(e + 1, '.')) {
+		if (*e != '.' && *e != '/')
+			continue;
 
-		m++;
+		m = bsearch(e + 1, mime_types, n_mime_types, sizeof(*m),
+			    mimetype_find_cmp);
+		if (m)
+			return m->mime;
 	}
 
 	return "application/octet-stream";
@@ -294,46 +551,22 @@ static const char * uh_file_mktag(struct stat *s, char *buf, int len)
 	return buf;
 }
 
-static time_t uh_file_date2unix(const char *date)
-{
-	struct tm t;
-
-	memset(&t, 0, sizeof(t));
-
-	if (strptime(date, "%a, %d %b %Y %H:%M:%S %Z", &t) != NULL)
-		return timegm(&t);
-
-	return 0;
-}
-
-static char * uh_file_unix2date(time_t ts, char *buf, int len)
-{
-	struct tm *t = gmtime(&ts);
-
-	strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", t);
-
-	return buf;
-}
-
-static char *uh_file_header(struct client *cl, int idx)
-{
-	if (!cl->dispatch.file.hdr[idx])
-		return NULL;
-
-	return (char *) blobmsg_data(cl->dispatch.file.hdr[idx]);
-}
-
 static void uh_file_response_ok_hdrs(struct client *cl, struct stat *s)
 {
 	char buf[128];
 
+	if (cl->dispatch.file.encoding)
+		uh_response_printf(cl, "Content-Encoding: %s\r\n", cl->dispatch.file.encoding);
+
+	/* the identity response depends on Accept-Encoding just as well */
+	if (conf.precompressed && s)
+		uh_response_printf(cl, "Vary: Accept-Encoding\r\n");
+
 	if (s) {
-		ustream_printf(cl->us, "ETag: %s\r\n", uh_file_mktag(s, buf, sizeof(buf)));
-		ustream_printf(cl->us, "Last-Modified: %s\r\n",
-			       uh_file_unix2date(s->st_mtime, buf, sizeof(buf)));
+		uh_response_printf(cl, "ETag: %s\r\n", uh_file_mktag(s, buf, sizeof(buf)));
+		uh_response_printf(cl, "Last-Modified: %s\r\n",
+			       uh_unix2date(s->st_mtime, buf, sizeof(buf)));
 	}
-	ustream_printf(cl->us, "Date: %s\r\n",
-		       uh_file_unix2date(time(NULL), buf, sizeof(buf)));
 }
 
 static void uh_file_response_200(struct client *cl, struct stat *s)
@@ -358,7 +591,7 @@ static bool uh_file_if_match(struct client *cl, struct stat *s)
 {
 	char buf[128];
 	const char *tag = uh_file_mktag(s, buf, sizeof(buf));
-	char *hdr = uh_file_header(cl, HDR_IF_MATCH);
+	char *hdr = uh_header(cl, UH_HDR_IF_MATCH);
 	char *p;
 	int i;
 
@@ -382,12 +615,12 @@ static bool uh_file_if_match(struct client *cl, struct stat *s)
 
 static int uh_file_if_modified_since(struct client *cl, struct stat *s)
 {
-	char *hdr = uh_file_header(cl, HDR_IF_MODIFIED_SINCE);
+	char *hdr = uh_header(cl, UH_HDR_IF_MODIFIED_SINCE);
 
 	if (!hdr)
 		return true;
 
-	if (uh_file_date2unix(hdr) >= s->st_mtime) {
+	if (uh_date2unix(hdr) >= s->st_mtime) {
 		uh_file_response_304(cl, s);
 		return false;
 	}
@@ -399,7 +632,7 @@ static int uh_file_if_none_match(struct client *cl, struct stat *s)
 {
 	char buf[128];
 	const char *tag = uh_file_mktag(s, buf, sizeof(buf));
-	char *hdr = uh_file_header(cl, HDR_IF_NONE_MATCH);
+	char *hdr = uh_header(cl, UH_HDR_IF_NONE_MATCH);
 	char *p;
 	int i;
 
@@ -425,23 +658,120 @@ static int uh_file_if_none_match(struct client *cl, struct stat *s)
 	return true;
 }
 
-static int uh_file_if_range(struct client *cl, struct stat *s)
+/* Returns true if a Range header may be honoured, that is if there is no
+** If-Range header or its validator still matches the current file. */
+static bool uh_file_if_range(struct client *cl, struct stat *s)
 {
-	char *hdr = uh_file_header(cl, HDR_IF_RANGE);
+	char buf[128];
+	char *hdr = uh_header(cl, UH_HDR_IF_RANGE);
 
-	if (hdr) {
-		uh_file_response_412(cl);
+	if (!hdr)
+		return true;
+
+	if (hdr[0] == '"')
+		return !strcmp(hdr, uh_file_mktag(s, buf, sizeof(buf)));
+
+	/* weak entity tags must not be used for range requests */
+	if (!strncmp(hdr, "W/", 2))
 		return false;
+
+	return uh_date2unix(hdr) == s->st_mtime;
+}
+
+/* Parses the Range header into cl->dispatch.file.ranges. Returns the number
+** of satisfiable ranges, 0 if the header is absent, malformed or should be
+** ignored (send the entire file) and -1 if no range can be satisfied. */
+static int uh_file_parse_ranges(struct client *cl, struct stat *s)
+{
+	struct dispatch_file *f = &cl->dispatch.file;
+	char *hdr = uh_header(cl, UH_HDR_RANGE);
+	uint64_t size = s->st_size;
+	uint64_t start, end;
+	bool unsatisfiable = false;
+	char *p, *err;
+	int n = 0;
+
+	if (!hdr || strncasecmp(hdr, "bytes=", 6))
+		return 0;
+
+	if (!uh_file_if_range(cl, s))
+		return 0;
+
+	for (p = hdr + 6; *p; p = err) {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+
+		if (!*p)
+			break;
+
+		if (*p == '-') {
+			/* suffix range, last N bytes */
+			if (!isdigit(p[1]))
+				return 0;
+
+			end = strtoull(p + 1, &err, 10);
+
+			if (!end || !size) {
+				unsatisfiable = true;
+				goto next;
+			}
+
+			start = end < size ? size - end : 0;
+			end = size - 1;
+		} else {
+			if (!isdigit(*p))
+				return 0;
+
+			start = strtoull(p, &err, 10);
+			if (*err != '-')
+				return 0;
+
+			p = err + 1;
+			if (isdigit(*p)) {
+				end = strtoull(p, &err, 10);
+				if (end < start)
+					return 0;
+			} else {
+				end = size - 1;
+				err = p;
+			}
+
+			if (start >= size) {
+				unsatisfiable = true;
+				goto next;
+			}
+
+			if (end >= size)
+				end = size - 1;
+		}
+
+		/* ignore excessive range sets instead of serving them */
+		if (n == ARRAY_SIZE(f->ranges))
+			return 0;
+
+		f->ranges[n].start = start;
+		f->ranges[n].end = end + 1;
+		n++;
+
+next:
+		while (*err == ' ' || *err == '\t')
+			err++;
+
+		if (*err && *err != ',')
+			return 0;
 	}
 
-	return true;
+	if (!n)
+		return unsatisfiable ? -1 : 0;
+
+	return n;
 }
 
 static int uh_file_if_unmodified_since(struct client *cl, struct stat *s)
 {
-	char *hdr = uh_file_header(cl, HDR_IF_UNMODIFIED_SINCE);
+	char *hdr = uh_header(cl, UH_HDR_IF_UNMODIFIED_SINCE);
 
-	if (hdr && uh_file_date2unix(hdr) <= s->st_mtime) {
+	if (hdr && uh_date2unix(hdr) <= s->st_mtime) {
 		uh_file_response_412(cl);
 		return false;
 	}
@@ -461,12 +791,87 @@ static int dirent_cmp(const struct dirent **a, const struct dirent **b)
 	return alphasort(a, b);
 }
 
-static void list_entries(struct client *cl, struct dirent **files, int count,
-			 const char *path, char *local_path)
+struct dirlist_buf {
+	char *data;
+	int len, size;
+	bool error;
+};
+
+static bool dirlist_reserve(struct dirlist_buf *b, int len)
+{
+	int size = b->size ? b->size : 4096;
+	char *data;
+
+	if (b->error)
+		return false;
+
+	if (b->len + len < b->size)
+		return true;
+
+	while (b->len + len >= size)
+		size *= 2;
+
+	data = realloc(b->data, size);
+	if (!data) {
+		b->error = true;
+		return false;
+	}
+
+	b->data = data;
+	b->size = size;
+
+	return true;
+}
+
+static void __printf(2, 3) dirlist_printf(struct dirlist_buf *b, const char *format, ...)
+{
+	va_list arg;
+	int len;
+
+	if (!dirlist_reserve(b, 256))
+		return;
+
+	va_start(arg, format);
+	len = vsnprintf(b->data + b->len, b->size - b->len, format, arg);
+	va_end(arg);
+
+	if (b->len + len >= b->size) {
+		if (!dirlist_reserve(b, len))
+			return;
+
+		va_start(arg, format);
+		vsnprintf(b->data + b->len, b->size - b->len, format, arg);
+		va_end(arg);
+	}
+
+	b->len += len;
+}
+
+static void dirlist_json_string(struct dirlist_buf *b, const char *str)
+{
+	const unsigned char *p;
+
+	dirlist_printf(b, "\"");
+
+	for (p = (const unsigned char *) str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			dirlist_printf(b, "\\%c", *p);
+		else if (*p < 0x20)
+			dirlist_printf(b, "\\u%04x", *p);
+		else if (dirlist_reserve(b, 1))
+			b->data[b->len++] = *p;
+	}
+
+	dirlist_printf(b, "\"");
+}
+
+static void list_entries(struct dirlist_buf *b, struct dirent **files, int count,
+			 const char *path, char *local_path, bool json)
 {
 	const char *suffix = "/";
 	const char *type = "directory";
 	unsigned int mode = S_IXOTH;
+	bool first = true;
 	struct stat s;
 	char *file;
 	char buf[128];
@@ -493,15 +898,23 @@ static void list_entries(struct client *cl, struct dirent **files, int count,
 		if (!(s.st_mode & mode))
 			goto next;
 
-		uh_chunk_printf(cl,
+		if (json) {
+			dirlist_printf(b, "%s{\"name\":", first ? "" : ",");
+			dirlist_json_string(b, name);
+			dirlist_printf(b, ",\"type\":\"%s\",\"size\":%" PRIu64 ",\"mtime\":%" PRIu64 "}",
+				       type, (uint64_t) s.st_size, (uint64_t) s.st_mtime);
+			first = false;
+		} else {
+			dirlist_printf(b,
 				"<li><strong><a href='%s%s%s'>%s</a>%s"
 				"</strong><br /><small>modified: %s"
 				"<br />%s - %.02f kbyte<br />"
 				"<br /></small></li>",
 				path, name, suffix,
 				name, suffix,
-				uh_file_unix2date(s.st_mtime, buf, sizeof(buf)),
+				uh_unix2date(s.st_mtime, buf, sizeof(buf)),
 				type, s.st_size / 1024.0);
+		}
 
 		*file = 0;
 next:
@@ -509,100 +922,869 @@ next:
 	}
 }
 
-static void uh_file_dirlist(struct client *cl, struct path_info *pi)
+static void uh_dirlist_free(struct dirlist_cache_entry *e)
 {
-	struct dirent **files = NULL;
-	int count = 0;
-
-	uh_file_response_200(cl, NULL);
-	ustream_printf(cl->us, "Content-Type: text/html\r\n\r\n");
+	free(e->body);
+	free(e);
+}
 
-	uh_chunk_printf(cl,
-		"<html><head><title>Index of %s</title></head>"
-		"<body><h1>Index of %s</h1><hr /><ol>",
-		pi->name, pi->name);
+static struct dirlist_cache_entry **uh_dirlist_cache_slot(const char *phys, bool json)
+{
+	unsigned int hash = 5381 + json;
 
-	count = scandir(pi->phys, &files, NULL, dirent_cmp);
-	if (count > 0) {
-		strcpy(uh_buf, pi->phys);
-		list_entries(cl, files, count, pi->name, uh_buf);
-	}
-	free(files);
+	while (*phys)
+		hash = (hash * 33) ^ (unsigned char) *phys++;
 
-	uh_chunk_printf(cl, "</ol><hr /></body></html>");
-	uh_request_done(cl);
+	return &dirlist_cache[hash % UH_DIRLIST_CACHE_SIZE];
 }
 
-static void file_write_cb(struct client *cl)
+static struct dirlist_cache_entry *
+uh_dirlist_cache_get(struct path_info *pi, struct stat *s, bool json)
 {
-	int fd = cl->dispatch.file.fd;
-	int r;
+	struct dirlist_cache_entry **slot, *e;
 
-	while (cl->us->w.data_bytes < 256) {
-		r = read(fd, uh_buf, sizeof(uh_buf));
-		if (r < 0) {
-			if (errno == EINTR)
-				continue;
-		}
+	if (conf.dirlist_cache_ttl <= 0)
+		return NULL;
 
-		if (!r) {
-			uh_request_done(cl);
-			return;
-		}
+	slot = uh_dirlist_cache_slot(pi->phys, json);
+	e = *slot;
 
-		uh_chunk_write(cl, uh_buf, r);
+	if (!e || e->json != json || strcmp(e->phys, pi->phys) || strcmp(e->name, pi->name))
+		return NULL;
+
+	/* entries changing in place do not touch the directory mtime, hence the ttl */
+	if (e->ino != s->st_ino || e->mtime != s->st_mtime ||
+	    uh_path_cache_now() >= e->expires) {
+		uh_dirlist_free(e);
+		*slot = NULL;
+		return NULL;
 	}
+
+	return e;
 }
 
-static void uh_file_free(struct client *cl)
+static bool uh_dirlist_cache_add(struct dirlist_cache_entry *e)
 {
-	close(cl->dispatch.file.fd);
+	struct dirlist_cache_entry **slot;
+
+	if (conf.dirlist_cache_ttl <= 0 || e->len > UH_DIRLIST_CACHE_MAX)
+		return false;
+
+	e->expires = uh_path_cache_now() + conf.dirlist_cache_ttl;
+
+	slot = uh_dirlist_cache_slot(e->phys, e->json);
+	if (*slot)
+		uh_dirlist_free(*slot);
+	*slot = e;
+
+	return true;
 }
 
-static void uh_file_data(struct client *cl, struct path_info *pi, int fd)
+static struct dirlist_cache_entry *
+uh_dirlist_render(struct path_info *pi, struct stat *s, bool json)
 {
-	/* test preconditions */
-	if (!uh_file_if_modified_since(cl, &pi->stat) ||
-		!uh_file_if_match(cl, &pi->stat) ||
-		!uh_file_if_range(cl, &pi->stat) ||
-		!uh_file_if_unmodified_since(cl, &pi->stat) ||
-		!uh_file_if_none_match(cl, &pi->stat)) {
-		ustream_printf(cl->us, "\r\n");
-		uh_request_done(cl);
-		close(fd);
-		return;
+	struct dirlist_cache_entry *e;
+	struct dirlist_buf b = {};
+	struct dirent **files = NULL;
+	unsigned int hash = 5381;
+	char *_phys, *_name;
+	int count, i;
+
+	if (json) {
+		dirlist_printf(&b, "{\"path\":");
+		dirlist_json_string(&b, pi->name);
+		dirlist_printf(&b, ",\"entries\":[");
+	} else {
+		dirlist_printf(&b,
+			"<html><head><title>Index of %s</title></head>"
+			"<body><h1>Index of %s</h1><hr /><ol>",
+			pi->name, pi->name);
 	}
 
-	/* write status */
-	uh_file_response_200(cl, &pi->stat);
-
-	ustream_printf(cl->us, "Content-Type: %s\r\n",
-			   uh_file_mime_lookup(pi->name));
+	count = scandir(pi->phys, &files, NULL, dirent_cmp);
+	if (count > 0) {
+		strcpy(uh_buf, pi->phys);
+		list_entries(&b, files, count, pi->name, uh_buf, json);
+	}
+	free(files);
 
-	ustream_printf(cl->us, "Content-Length: %" PRIu64 "\r\n\r\n",
-			   pi->stat.st_size);
+	dirlist_printf(&b, json ? "]}\n" : "</ol><hr /></body></html>");
 
+	e = calloc_a(sizeof(*e),
+		&_phys, strlen(pi->phys) + 1,
+		&_name, strlen(pi->name) + 1);
 
-	/* send body */
-	if (cl->request.method == UH_HTTP_MSG_HEAD) {
-		uh_request_done(cl);
-		close(fd);
-		return;
+	if (!e || b.error) {
+		free(b.data);
+		free(e);
+		return NULL;
 	}
 
-	cl->dispatch.file.fd = fd;
-	cl->dispatch.write_cb = file_write_cb;
+	e->phys = strcpy(_phys, pi->phys);
+	e->name = strcpy(_name, pi->name);
+	e->json = json;
+	e->ino = s->st_ino;
+	e->mtime = s->st_mtime;
+	e->body = b.data;
+	e->len = b.len;
+
+	for (i = 0; i < b.len; i++)
+		hash = (hash * 33) ^ (unsigned char) b.data[i];
+
+	snprintf(e->tag, sizeof(e->tag), "\"%x-%x\"", e->len, hash);
+
+	return e;
+}
+
+static bool uh_dirlist_not_modified(struct client *cl, const char *tag)
+{
+	char *hdr = uh_header(cl, UH_HDR_IF_NONE_MATCH);
+	int len = strlen(tag);
+	int n;
+
+	if (!hdr)
+		return false;
+
+	while (*hdr) {
+		hdr += strspn(hdr, " \t,");
+		if (!strncmp(hdr, "W/", 2))
+			hdr += 2;
+
+		n = strcspn(hdr, " \t,");
+		if ((n == 1 && *hdr == '*') || (n == len && !strncmp(hdr, tag, len)))
+			return true;
+
+		hdr += n;
+	}
+
+	return false;
+}
+
+static void uh_file_dirlist(struct client *cl, struct path_info *pi)
+{
+	bool json = pi->query && !strcmp(pi->query, "json");
+	struct dirlist_cache_entry *e;
+	bool cached = true;
+	struct stat s;
+
+	/* a stat from the path cache may be outdated */
+	if (stat(pi->phys, &s))
+		memcpy(&s, &pi->stat, sizeof(s));
+
+	e = uh_dirlist_cache_get(pi, &s, json);
+	if (!e) {
+		e = uh_dirlist_render(pi, &s, json);
+		if (!e) {
+			uh_client_error(cl, 500, "Internal Server Error", "Out of memory");
+			return;
+		}
+
+		cached = uh_dirlist_cache_add(e);
+	}
+
+	/* the whole body is known, send it with a length instead of chunks */
+	cl->request.respond_chunked = false;
+
+	if (uh_dirlist_not_modified(cl, e->tag)) {
+		uh_http_header(cl, 304, "Not Modified");
+		uh_response_printf(cl, "ETag: %s\r\n\r\n", e->tag);
+	} else {
+		uh_file_response_200(cl, NULL);
+		uh_response_printf(cl, "Content-Type: %s\r\nETag: %s\r\nContent-Length: %d\r\n\r\n",
+				   json ? "application/json" : "text/html", e->tag, e->len);
+
+		if (cl->request.method != UH_HTTP_MSG_HEAD)
+			uh_response_write(cl, e->body, e->len);
+	}
+
+	if (!cached)
+		uh_dirlist_free(e);
+
+	uh_request_done(cl);
+}
+
+static void uh_file_range_part(struct client *cl)
+{
+	struct dispatch_file *f = &cl->dispatch.file;
+
+	ustream_printf(cl->us, UH_RANGE_PART_FMT, f->boundary, f->mime,
+		       (uint64_t)f->pos, (uint64_t)f->end - 1, (uint64_t)f->size);
+}
+
+/* Advances to the next range once the current one has been sent, emitting
+** the multipart framing in between. Returns false when the body is done. */
+static bool uh_file_next_range(struct client *cl)
+{
+	struct dispatch_file *f = &cl->dispatch.file;
+
+	if (f->pos < f->end)
+		return true;
+
+	if (++f->range >= f->n_ranges) {
+		if (f->n_ranges > 1 && f->range == f->n_ranges)
+			ustream_printf(cl->us, "\r\n--%s--\r\n", f->boundary);
+
+		f->range = f->n_ranges;
+		return false;
+	}
+
+	f->pos = f->ranges[f->range].start;
+	f->end = f->ranges[f->range].end;
+	uh_file_range_part(cl);
+
+	return true;
+}
+
+/* The file shrank while it was being sent, the announced Content-Length
+** can't be met anymore so the connection has to be closed. */
+static void uh_file_truncated(struct client *cl)
+{
+	cl->request.connection_close = true;
+	uh_request_done(cl);
+}
+
+#ifdef linux
+static void file_write_cb(struct client *cl);
+
+static void file_sendfile_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct client *cl = container_of(fd, struct client, dispatch.file.wrfd);
+
+	file_write_cb(cl);
+}
+
+/* Returns false if the kernel refused to sendfile() from this fd, in which
+** case the caller falls back to copying the data through the ustream. */
+static bool file_sendfile(struct client *cl)
+{
+	struct dispatch_file *f = &cl->dispatch.file;
+	struct uloop_fd *wrfd = &f->wrfd;
+	ssize_t r;
+
+	if (cl->state == CLIENT_STATE_CLEANUP)
+		return true;
+
+	while (1) {
+		if (f->pos >= f->end && !uh_file_next_range(cl)) {
+			uh_request_done(cl);
+			return true;
+		}
+
+		/* headers are still queued, wait until ustream flushed them */
+		if (ustream_pending_data(cl->us, true))
+			return true;
+
+		r = sendfile(cl->sfd.fd.fd, f->fd, &f->pos,
+			     min(f->end - f->pos, UH_SENDFILE_CHUNK));
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			if (errno == EINVAL || errno == ENOSYS)
+				return false;
+
+			cl->us->write_error = true;
+			ustream_state_change(cl->us);
+			return true;
+		}
+
+		if (!r) {
+			uh_file_truncated(cl);
+			return true;
+		}
+
+		uh_metrics.bytes_out += r;
+		uh_client_touch(cl);
+	}
+
+	/* socket buffer is full, poll a duplicate of the client fd for
+	   writability since the original one is owned by the ustream */
+	if (wrfd->fd < 0) {
+		wrfd->fd = dup(cl->sfd.fd.fd);
+		if (wrfd->fd < 0)
+			return false;
+
+		fd_cloexec(wrfd->fd);
+		wrfd->cb = file_sendfile_cb;
+	}
+
+	uloop_fd_add(wrfd, ULOOP_WRITE);
+	return true;
+}
+#else
+static inline bool file_sendfile(struct client *cl)
+{
+	return false;
+}
+#endif
+
+static void file_write_cb(struct client *cl)
+{
+	struct dispatch_file *f = &cl->dispatch.file;
+	int r;
+
+	if (f->sendfile) {
+		if (file_sendfile(cl))
+			return;
+
+		f->sendfile = false;
+		if (f->wrfd.fd >= 0)
+			uloop_fd_delete(&f->wrfd);
+	}
+
+	while (cl->us->w.data_bytes < 256) {
+		if (f->pos >= f->end && !uh_file_next_range(cl)) {
+			uh_request_done(cl);
+			return;
+		}
+
+		r = pread(f->fd, uh_buf, min(f->end - f->pos, sizeof(uh_buf)), f->pos);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+		}
+
+		if (r <= 0) {
+			uh_file_truncated(cl);
+			return;
+		}
+
+		f->pos += r;
+		uh_chunk_write(cl, uh_buf, r);
+	}
+}
+
+static void uh_file_free(struct client *cl)
+{
+	struct uloop_fd *wrfd = &cl->dispatch.file.wrfd;
+
+	if (wrfd->fd >= 0) {
+		uloop_fd_delete(wrfd);
+		close(wrfd->fd);
+	}
+
+	close(cl->dispatch.file.fd);
+}
+
+static int uh_file_child_fds(struct client *cl, int *fds)
+{
+	struct uloop_fd *wrfd = &cl->dispatch.file.wrfd;
+	int n = 0;
+
+	fds[n++] = cl->dispatch.file.fd;
+	if (wrfd->fd >= 0)
+		fds[n++] = wrfd->fd;
+
+	return n;
+}
+
+static void uh_file_response_416(struct client *cl, struct stat *s)
+{
+	uh_http_header(cl, 416, "Requested Range Not Satisfiable");
+	uh_file_response_ok_hdrs(cl, s);
+	uh_response_printf(cl, "Content-Range: bytes */%" PRIu64 "\r\n", s->st_size);
+	uh_response_printf(cl, "Content-Length: 0\r\n\r\n");
+}
+
+static void uh_file_data(struct client *cl, struct path_info *pi, int fd)
+{
+	struct dispatch_file *f = &cl->dispatch.file;
+	uint64_t len = 0;
+	int i, n = 0;
+
+	/* test preconditions */
+	if (!uh_file_if_modified_since(cl, &pi->stat) ||
+		!uh_file_if_match(cl, &pi->stat) ||
+		!uh_file_if_unmodified_since(cl, &pi->stat) ||
+		!uh_file_if_none_match(cl, &pi->stat)) {
+		uh_response_printf(cl, "\r\n");
+		uh_request_done(cl);
+		close(fd);
+		return;
+	}
+
+	if (cl->request.method == UH_HTTP_MSG_GET)
+		n = uh_file_parse_ranges(cl, &pi->stat);
+
+	if (n < 0) {
+		uh_file_response_416(cl, &pi->stat);
+		uh_request_done(cl);
+		close(fd);
+		return;
+	}
+
+	f->size = pi->stat.st_size;
+	f->mime = uh_file_mime_lookup(pi->name);
+
+	if (!n) {
+		f->ranges[0].start = 0;
+		f->ranges[0].end = f->size;
+		n = 1;
+
+		uh_file_response_200(cl, &pi->stat);
+		uh_response_printf(cl, "Accept-Ranges: bytes\r\n");
+		uh_response_printf(cl, "Content-Type: %s\r\n", f->mime);
+		len = f->size;
+	} else if (n == 1) {
+		uh_http_header(cl, 206, "Partial Content");
+		uh_file_response_ok_hdrs(cl, &pi->stat);
+		uh_response_printf(cl, "Content-Type: %s\r\n", f->mime);
+		uh_response_printf(cl, "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n",
+			       (uint64_t)f->ranges[0].start, (uint64_t)f->ranges[0].end - 1,
+			       (uint64_t)f->size);
+		len = f->ranges[0].end - f->ranges[0].start;
+	} else {
+		snprintf(f->boundary, sizeof(f->boundary), "uhttpd-%016" PRIx64,
+			 (uint64_t)pi->stat.st_ino ^ ((uint64_t)pi->stat.st_mtime << 20));
+
+		for (i = 0; i < n; i++) {
+			len += snprintf(NULL, 0, UH_RANGE_PART_FMT, f->boundary, f->mime,
+					(uint64_t)f->ranges[i].start,
+					(uint64_t)f->ranges[i].end - 1,
+					(uint64_t)f->size);
+			len += f->ranges[i].end - f->ranges[i].start;
+		}
+		len += snprintf(NULL, 0, "\r\n--%s--\r\n", f->boundary);
+
+		uh_http_header(cl, 206, "Partial Content");
+		uh_file_response_ok_hdrs(cl, &pi->stat);
+		uh_response_printf(cl, "Content-Type: multipart/byteranges; boundary=%s\r\n",
+			       f->boundary);
+	}
+
+	uh_response_printf(cl, "Content-Length: %" PRIu64 "\r\n\r\n", len);
+	uh_response_flush(cl);
+
+	/* send body */
+	if (cl->request.method == UH_HTTP_MSG_HEAD) {
+		uh_request_done(cl);
+		close(fd);
+		return;
+	}
+
+	f->fd = fd;
+	f->wrfd.fd = -1;
+	f->sendfile = !cl->tls && !cl->request.respond_chunked;
+	f->n_ranges = n;
+	f->range = 0;
+	f->pos = f->ranges[0].start;
+	f->end = f->ranges[0].end;
+	if (n > 1)
+		uh_file_range_part(cl);
+
+	cl->dispatch.write_cb = file_write_cb;
 	cl->dispatch.free = uh_file_free;
-	cl->dispatch.close_fds = uh_file_free;
+	cl->dispatch.child_fds = uh_file_child_fds;
 	file_write_cb(cl);
 }
 
 static bool __handle_file_request(struct client *cl, char *url);
 
+static bool uh_file_accept_encoding(const char *hdr, const char *name)
+{
+	int len = strlen(name);
+	const char *p = hdr, *end;
+
+	while (*p) {
+		p += strspn(p, ", \t");
+		end = p + strcspn(p, ",");
+
+		if (strncasecmp(p, name, len) ||
+		    (p[len] && !strchr(",; \t", p[len]))) {
+			p = end;
+			continue;
+		}
+
+		/* an explicit q=0 means the coding is not acceptable */
+		for (p += len; p < end && *p != ';'; p++);
+		if (p < end) {
+			p += strspn(p + 1, " \t") + 1;
+			if (!strncasecmp(p, "q=", 2))
+				return strtod(p + 2, NULL) > 0;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+/* Looks for a precompressed sibling of the requested file that the client
+** accepts. On success pi->stat is replaced by the stat of the sibling so
+** that it gets its own ETag, while the MIME type still follows pi->name. */
+static int uh_file_open_encoded(struct client *cl, struct path_info *pi)
+{
+	char path[PATH_MAX];
+	struct stat s;
+	const char *hdr;
+	int flags = O_RDONLY;
+	int i, fd;
+
+	hdr = uh_header(cl, UH_HDR_ACCEPT_ENCODING);
+	if (!hdr)
+		return -1;
+
+	if (conf.no_symlinks)
+		flags |= O_NOFOLLOW;
+
+	for (i = 0; i < ARRAY_SIZE(encodings); i++) {
+		if (!uh_file_accept_encoding(hdr, encodings[i].name))
+			continue;
+
+		if (snprintf(path, sizeof(path), "%s%s", pi->phys,
+			     encodings[i].ext) >= sizeof(path))
+			continue;
+
+		fd = open(path, flags);
+		if (fd < 0)
+			continue;
+
+		if (fstat(fd, &s) || !(s.st_mode & S_IFREG) ||
+		    !(s.st_mode & S_IROTH)) {
+			close(fd);
+			continue;
+		}
+
+		memcpy(&pi->stat, &s, sizeof(pi->stat));
+		cl->dispatch.file.encoding = encodings[i].name;
+		return fd;
+	}
+
+	return -1;
+}
+
+static void uh_file_cache_drop(struct file_cache_variant *v)
+{
+	file_cache_used -= v->len;
+	free(v->data);
+	memset(v, 0, sizeof(*v));
+}
+
+static void uh_file_cache_free(struct file_cache_entry *e)
+{
+	int i;
+
+	for (i = 0; i < UH_FILE_VARIANTS; i++)
+		uh_file_cache_drop(&e->var[i]);
+
+	avl_delete(&file_cache, &e->avl);
+	list_del(&e->list);
+	free(e);
+}
+
+static struct file_cache_entry *uh_file_cache_find(struct path_info *pi)
+{
+	struct file_cache_entry *e;
+
+	if (conf.file_cache_size <= 0 || !(pi->stat.st_mode & S_IFREG))
+		return NULL;
+
+	e = avl_find_element(&file_cache, pi->phys, e, avl);
+	if (!e)
+		return NULL;
+
+	if (e->ino != pi->stat.st_ino || e->size != pi->stat.st_size ||
+	    e->mtime != pi->stat.st_mtime) {
+		uh_file_cache_free(e);
+		return NULL;
+	}
+
+	return e;
+}
+
+/* The requested file is stat()ed for every request, but the precompressed
+** siblings are only looked at again once per path cache TTL. Returns false
+** if the sibling behind variant i is not what was last seen. */
+static bool uh_file_cache_recheck(struct file_cache_entry *e, int i)
+{
+	struct file_cache_variant *v = &e->var[i];
+	time_t now = uh_path_cache_now();
+	char path[PATH_MAX];
+	struct stat s;
+	bool found;
+
+	if (conf.path_cache_ttl > 0 && now < v->checked + conf.path_cache_ttl)
+		return true;
+
+	if (snprintf(path, sizeof(path), "%s%s", (const char *) e->avl.key,
+		     encodings[i].ext) >= sizeof(path))
+		return false;
+
+	found = !(conf.no_symlinks ? lstat(path, &s) : stat(path, &s)) &&
+		(s.st_mode & S_IFREG) && (s.st_mode & S_IROTH);
+
+	if (v->state == VARIANT_ABSENT ? found :
+	    (!found || s.st_ino != v->stat.st_ino || s.st_size != v->stat.st_size ||
+	     s.st_mtime != v->stat.st_mtime))
+		return false;
+
+	v->checked = now;
+	return true;
+}
+
+/* Picks the variant the response would be built from, NULL if one of the
+** candidates has not been looked at yet or changed since. */
+static struct file_cache_variant *
+uh_file_cache_variant(struct client *cl, struct file_cache_entry *e, int *idx)
+{
+	const char *hdr = uh_header(cl, UH_HDR_ACCEPT_ENCODING);
+	struct file_cache_variant *v;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(encodings); i++) {
+		if (!conf.precompressed || !hdr)
+			break;
+
+		if (!uh_file_accept_encoding(hdr, encodings[i].name))
+			continue;
+
+		v = &e->var[i];
+		if (v->state != VARIANT_UNKNOWN && !uh_file_cache_recheck(e, i))
+			uh_file_cache_drop(v);
+
+		if (v->state == VARIANT_UNKNOWN)
+			return NULL;
+
+		if (v->state == VARIANT_PRESENT) {
+			*idx = i;
+			return v;
+		}
+	}
+
+	v = &e->var[ARRAY_SIZE(encodings)];
+	if (v->state != VARIANT_PRESENT)
+		return NULL;
+
+	*idx = ARRAY_SIZE(encodings);
+	return v;
+}
+
+static bool uh_file_cache_request(struct client *cl)
+{
+	int method = cl->request.method;
+
+	if (method != UH_HTTP_MSG_GET && method != UH_HTTP_MSG_HEAD)
+		return false;
+
+	/* ranges are rare enough to be left to the regular path */
+	return !uh_header(cl, UH_HDR_RANGE);
+}
+
+static void uh_file_cache_send(struct client *cl, struct file_cache_variant *v, int idx)
+{
+	struct dispatch_file *f = &cl->dispatch.file;
+
+	cl->request.respond_chunked = false;
+	f->encoding = idx < ARRAY_SIZE(encodings) ? encodings[idx].name : NULL;
+
+	if (!uh_file_if_modified_since(cl, &v->stat) ||
+		!uh_file_if_match(cl, &v->stat) ||
+		!uh_file_if_unmodified_since(cl, &v->stat) ||
+		!uh_file_if_none_match(cl, &v->stat)) {
+		uh_response_printf(cl, "\r\n");
+		uh_request_done(cl);
+		return;
+	}
+
+	uh_http_header(cl, 200, "OK");
+	if (cl->request.method == UH_HTTP_MSG_HEAD)
+		uh_response_write(cl, v->data, v->hdr_len);
+	else
+		uh_response_write(cl, v->data, v->len);
+
+	uh_request_done(cl);
+}
+
+/* Serves a request from the cache, no file is opened or stat()ed on a hit. */
+static bool uh_file_cache_hit(struct client *cl, struct path_info *pi)
+{
+	struct file_cache_variant *v;
+	struct file_cache_entry *e;
+	int idx;
+
+	if (!uh_file_cache_request(cl))
+		return false;
+
+	e = uh_file_cache_find(pi);
+	if (!e)
+		return false;
+
+	v = uh_file_cache_variant(cl, e, &idx);
+	if (!v)
+		return false;
+
+	list_move(&e->list, &file_cache_lru);
+	uh_file_cache_send(cl, v, idx);
+	cl->dispatch.file.encoding = NULL;
+
+	return true;
+}
+
+static void uh_file_cache_evict(int len)
+{
+	struct file_cache_entry *e;
+
+	while (file_cache_used + len > conf.file_cache_size &&
+	       !list_empty(&file_cache_lru)) {
+		e = list_last_entry(&file_cache_lru, struct file_cache_entry, list);
+		uh_file_cache_free(e);
+	}
+}
+
+#define FILE_CACHE_HDRS \
+	"%sETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n" \
+	"Content-Type: %s\r\nContent-Length: %" PRIu64 "\r\n\r\n"
+
+static bool uh_file_cache_load(struct file_cache_entry *e, struct file_cache_variant *v,
+			       struct path_info *pi, int fd, const char *encoding)
+{
+	struct stat *s = &pi->stat;
+	const char *mime = uh_file_mime_lookup(pi->name);
+	char enc[64] = "", tag[128], date[128];
+	char *data;
+	int hdr_len, len;
+	ssize_t r;
+
+	if (encoding)
+		snprintf(enc, sizeof(enc), "Content-Encoding: %s\r\n", encoding);
+
+	if (conf.precompressed)
+		strcat(enc, "Vary: Accept-Encoding\r\n");
+
+	uh_file_mktag(s, tag, sizeof(tag));
+	uh_unix2date(s->st_mtime, date, sizeof(date));
+
+	hdr_len = snprintf(NULL, 0, FILE_CACHE_HDRS, enc, tag, date, mime,
+			   (uint64_t) s->st_size);
+
+	if (hdr_len + s->st_size > conf.file_cache_size)
+		return false;
+
+	/* make room by evicting the least recently used other entries */
+	list_del(&e->list);
+	uh_file_cache_evict(hdr_len + s->st_size);
+	list_add(&e->list, &file_cache_lru);
+
+	if (file_cache_used + hdr_len + s->st_size > conf.file_cache_size)
+		return false;
+
+	data = malloc(hdr_len + 1 + s->st_size);
+	if (!data)
+		return false;
+
+	snprintf(data, hdr_len + 1, FILE_CACHE_HDRS, enc, tag, date, mime,
+		 (uint64_t) s->st_size);
+
+	/* pread() keeps the offset in place for the uncached fallback */
+	for (len = 0; len < s->st_size; len += r) {
+		r = pread(fd, data + hdr_len + len, s->st_size - len, len);
+		if (r < 0 && errno == EINTR)
+			r = 0;
+		else if (r <= 0)
+			break;
+	}
+
+	if (len != s->st_size) {
+		free(data);
+		return false;
+	}
+
+	v->state = VARIANT_PRESENT;
+	v->checked = uh_path_cache_now();
+	memcpy(&v->stat, s, sizeof(v->stat));
+	v->data = data;
+	v->hdr_len = hdr_len;
+	v->len = hdr_len + len;
+	file_cache_used += v->len;
+
+	return true;
+}
+
+/* Adds the file just opened for a request to the cache. orig is the stat of
+** the requested file itself, pi->stat the one of the variant behind fd. */
+static struct file_cache_variant *
+uh_file_cache_add(struct client *cl, struct path_info *pi, struct stat *orig,
+		  int fd, int *idx)
+{
+	const char *hdr = uh_header(cl, UH_HDR_ACCEPT_ENCODING);
+	const char *encoding = cl->dispatch.file.encoding;
+	struct file_cache_variant *v;
+	struct file_cache_entry *e;
+	char *_phys;
+	int i;
+
+	if (conf.file_cache_size <= 0 || pi->stat.st_size > conf.file_cache_max ||
+	    !(orig->st_mode & S_IFREG))
+		return NULL;
+
+	for (i = 0; i < ARRAY_SIZE(encodings); i++)
+		if (encoding && !strcmp(encodings[i].name, encoding))
+			break;
+
+	e = avl_find_element(&file_cache, pi->phys, e, avl);
+	if (e && (e->ino != orig->st_ino || e->size != orig->st_size ||
+		  e->mtime != orig->st_mtime)) {
+		uh_file_cache_free(e);
+		e = NULL;
+	}
+
+	if (!e) {
+		e = calloc_a(sizeof(*e), &_phys, strlen(pi->phys) + 1);
+		if (!e)
+			return NULL;
+
+		e->avl.key = strcpy(_phys, pi->phys);
+		e->ino = orig->st_ino;
+		e->size = orig->st_size;
+		e->mtime = orig->st_mtime;
+		avl_insert(&file_cache, &e->avl);
+		list_add(&e->list, &file_cache_lru);
+	}
+
+	/* the accepted encodings tried before the one that was opened do not exist */
+	if (conf.precompressed && hdr) {
+		int j;
+
+		for (j = 0; j < i; j++) {
+			if (!uh_file_accept_encoding(hdr, encodings[j].name))
+				continue;
+
+			uh_file_cache_drop(&e->var[j]);
+			e->var[j].state = VARIANT_ABSENT;
+			e->var[j].checked = uh_path_cache_now();
+		}
+	}
+
+	v = &e->var[i];
+	if (v->state == VARIANT_PRESENT)
+		return NULL;
+
+	if (!uh_file_cache_load(e, v, pi, fd, encoding)) {
+		/* an entry holding no data would never be evicted */
+		for (i = 0; i < UH_FILE_VARIANTS; i++)
+			if (e->var[i].state == VARIANT_PRESENT)
+				break;
+
+		if (i == UH_FILE_VARIANTS)
+			uh_file_cache_free(e);
+
+		return NULL;
+	}
+
+	*idx = i;
+	return v;
+}
+
 static void uh_file_request(struct client *cl, const char *url,
-			    struct path_info *pi, struct blob_attr **tb)
+			    struct path_info *pi)
 {
-	int fd;
+	struct file_cache_variant *v;
+	struct stat st;
+	int fd, idx;
 	struct http_request *req = &cl->request;
 	char *error_handler;
 
@@ -610,14 +1792,45 @@ static void uh_file_request(struct client *cl, const char *url,
 		goto error;
 
 	if (pi->stat.st_mode & S_IFREG) {
-		fd = open(pi->phys, O_RDONLY);
-		if (fd < 0)
-			goto error;
+		if (uh_file_cache_hit(cl, pi))
+			return;
+
+		memcpy(&st, &pi->stat, sizeof(st));
+
+		fd = -1;
+		if (conf.precompressed)
+			fd = uh_file_open_encoded(cl, pi);
+
+		if (fd < 0) {
+			fd = open(pi->phys, O_RDONLY);
+			if (fd < 0) {
+				if (errno == ENOENT)
+					uh_path_cache_drop(url);
+				goto error;
+			}
+
+			/* the cached stat may be outdated, refresh it from the open file */
+			if (conf.path_cache_ttl > 0 &&
+			    (fstat(fd, &pi->stat) || !(pi->stat.st_mode & S_IFREG))) {
+				close(fd);
+				goto error;
+			}
+
+			memcpy(&st, &pi->stat, sizeof(st));
+		}
 
 		req->respond_chunked = false;
-		cl->dispatch.file.hdr = tb;
+
+		if (uh_file_cache_request(cl) &&
+		    (v = uh_file_cache_add(cl, pi, &st, fd, &idx)) != NULL) {
+			close(fd);
+			uh_file_cache_send(cl, v, idx);
+			cl->dispatch.file.encoding = NULL;
+			return;
+		}
+
 		uh_file_data(cl, pi, fd);
-		cl->dispatch.file.hdr = NULL;
+		cl->dispatch.file.encoding = NULL;
 		return;
 	}
 
@@ -683,22 +1896,111 @@ uh_invoke_script(struct client *cl, struct dispatch_handler *d, struct path_info
 	d->handle_request(cl, url, pi);
 }
 
+void uh_script_requests(int *running, int *queued)
+{
+	*running = n_requests;
+	*queued = n_queued;
+}
+
+static enum script_class uh_script_class(struct dispatch_handler *d)
+{
+	/* ubus calls are asynchronous and event streams stay open, so the
+	 * ubus handler takes no script slot and never gets here */
+	switch (d->type) {
+	case UH_HANDLER_LUA:
+		return SCRIPT_CLASS_API;
+	default:
+		return SCRIPT_CLASS_BULK;
+	}
+}
+
+static void uh_script_busy(struct client *cl)
+{
+	/* a request body might still be unread, do not reuse the connection */
+	cl->request.connection_close = true;
+
+	uh_http_header(cl, 503, "Service Unavailable");
+	uh_response_printf(cl, "Retry-After: %d\r\nContent-Type: text/html\r\n\r\n",
+			   UH_SCRIPT_RETRY_AFTER);
+	uh_chunk_printf(cl, "<h1>Service Unavailable</h1>"
+			"Too many script requests are waiting, please retry later.");
+	uh_request_done(cl);
+}
+
+static void uh_queue_timeout_cb(struct uloop_timeout *t);
+
+static struct uloop_timeout queue_timer = {
+	.cb = uh_queue_timeout_cb,
+};
+
+static void uh_queue_timer_update(void)
+{
+	struct deferred_request *dr;
+	uint64_t next = 0, now;
+	int i;
+
+	for (i = 0; i < __SCRIPT_CLASS_MAX; i++) {
+		if (list_empty(&pending_requests[i]))
+			continue;
+
+		dr = list_first_entry(&pending_requests[i], struct deferred_request, list);
+		if (!next || dr->expires < next)
+			next = dr->expires;
+	}
+
+	if (!next) {
+		uloop_timeout_cancel(&queue_timer);
+		return;
+	}
+
+	now = uh_metrics_now();
+	uloop_timeout_set(&queue_timer, next > now ? (next - now + 999) / 1000 : 0);
+}
+
+/* the oldest requests of each class are at the head, expire them from there */
+static void uh_queue_timeout_cb(struct uloop_timeout *t)
+{
+	struct deferred_request *dr;
+	uint64_t now = uh_metrics_now();
+	int i;
+
+	for (i = 0; i < __SCRIPT_CLASS_MAX; i++) {
+		while (!list_empty(&pending_requests[i])) {
+			dr = list_first_entry(&pending_requests[i], struct deferred_request, list);
+			if (dr->expires > now)
+				break;
+
+			/* removes dr from the queue through uh_free_pending_request() */
+			uh_script_busy(dr->cl);
+		}
+	}
+
+	uh_queue_timer_update();
+}
+
 static void uh_complete_request(struct client *cl)
 {
 	struct deferred_request *dr;
+	int i;
 
 	n_requests--;
 
-	while (!list_empty(&pending_requests)) {
-		if (n_requests >= conf.max_script_requests)
-			return;
+	for (i = 0; i < __SCRIPT_CLASS_MAX; i++) {
+		while (!list_empty(&pending_requests[i])) {
+			if (n_requests >= conf.max_script_requests)
+				goto out;
 
-		dr = list_first_entry(&pending_requests, struct deferred_request, list);
-		list_del(&dr->list);
+			dr = list_first_entry(&pending_requests[i], struct deferred_request, list);
+			list_del(&dr->list);
+			n_queued--;
 
-		dr->called = true;
-		uh_invoke_script(dr->cl, dr->d, dr->path ? &dr->pi : NULL);
+			dr->called = true;
+			uh_invoke_script(dr->cl, dr->d, dr->path ? &dr->pi : NULL);
+		}
 	}
+
+out:
+	uh_queue_timer_update();
 }
 
 
@@ -707,11 +2009,42 @@ uh_free_pending_request(struct client *cl)
 {
 	struct deferred_request *dr = cl->dispatch.req_data;
 
-	if (dr->called)
+	if (dr->called) {
 		uh_complete_request(cl);
-	else
+	} else {
 		list_del(&dr->list);
-	free(dr);
+		n_queued--;
+	}
+}
+
+static bool uh_addr_equal(struct uh_addr *a, struct uh_addr *b)
+{
+	if (a->family != b->family)
+		return false;
+
+	if (a->family == AF_INET)
+		return !memcmp(&a->in, &b->in, sizeof(a->in));
+
+	return !memcmp(&a->in6, &b->in6, sizeof(a->in6));
+}
+
+/* No peer may hold more than half of the queue, so that a single client
+** flooding script requests cannot lock everybody else out. */
+static bool uh_queue_admit(struct client *cl)
+{
+	struct deferred_request *dr;
+	int quota = max(1, conf.max_script_queue / 2);
+	int i, n = 0;
+
+	if (n_queued >= conf.max_script_queue)
+		return false;
+
+	for (i = 0; i < __SCRIPT_CLASS_MAX; i++)
+		list_for_each_entry(dr, &pending_requests[i], list)
+			if (uh_addr_equal(&dr->cl->peer_addr, &cl->peer_addr) && ++n >= quota)
+				return false;
+
+	return true;
 }
 
 static int field_len(const char *ptr)
@@ -734,36 +2067,58 @@ static void
 uh_defer_script(struct client *cl, struct dispatch_handler *d, struct path_info *pi)
 {
 	struct deferred_request *dr;
-	char *_root, *_phys, *_name, *_info, *_query, *_auth;
+	char *str;
 
-	cl->dispatch.req_free = uh_free_pending_request;
+	if (!uh_queue_admit(cl))
+		return uh_script_busy(cl);
 
 	if (pi) {
-		/* allocate enough memory to duplicate all path_info strings in one block */
+		/* carve the path_info string copies from the same arena block */
 #undef _field
-#define _field(_name) &_##_name, field_len(pi->_name),
-		dr = calloc_a(sizeof(*dr), path_info_fields NULL);
+#define _field(_name) + field_len(pi->_name)
+		dr = uh_arena_alloc(cl, sizeof(*dr) path_info_fields);
+		if (!dr)
+			goto error;
 
 		memcpy(&dr->pi, pi, sizeof(*pi));
 		dr->path = true;
 
 		/* copy all path_info strings */
+		str = (char *) (dr + 1);
 #undef _field
-#define _field(_name) if (pi->_name) dr->pi._name = strcpy(_##_name, pi->_name);
+#define _field(_name) \
+		if (pi->_name) { \
+			dr->pi._name = strcpy(str, pi->_name); \
+			str += field_len(pi->_name); \
+		}
 		path_info_fields
 	} else {
-		dr = calloc(1, sizeof(*dr));
+		dr = uh_arena_alloc(cl, sizeof(*dr));
+		if (!dr)
+			goto error;
 	}
 
+	cl->dispatch.req_free = uh_free_pending_request;
 	cl->dispatch.req_data = dr;
 	dr->cl = cl;
 	dr->d = d;
-	list_add(&dr->list, &pending_requests);
+	dr->expires = uh_metrics_now() + conf.script_timeout * 1000000ULL;
+	list_add_tail(&dr->list, &pending_requests[uh_script_class(d)]);
+	n_queued++;
+
+	if (!queue_timer.pending)
+		uh_queue_timer_update();
+	return;
+
+error:
+	uh_client_error(cl, 500, "Internal Server Error", "Out of memory");
 }
 
 static void
 uh_invoke_handler(struct client *cl, struct dispatch_handler *d, char *url, struct path_info *pi)
 {
+	cl->request.handler = d->type;
+
 	if (!d->script)
 		return d->handle_request(cl, url, pi);
 
@@ -776,16 +2131,7 @@ uh_invoke_handler(struct client *cl, struct dispatch_handler *d, char *url, stru
 
 static bool __handle_file_request(struct client *cl, char *url)
 {
-	static const struct blobmsg_policy hdr_policy[__HDR_MAX] = {
-		[HDR_AUTHORIZATION] = { "authorization", BLOBMSG_TYPE_STRING },
-		[HDR_IF_MODIFIED_SINCE] = { "if-modified-since", BLOBMSG_TYPE_STRING },
-		[HDR_IF_UNMODIFIED_SINCE] = { "if-unmodified-since", BLOBMSG_TYPE_STRING },
-		[HDR_IF_MATCH] = { "if-match", BLOBMSG_TYPE_STRING },
-		[HDR_IF_NONE_MATCH] = { "if-none-match", BLOBMSG_TYPE_STRING },
-		[HDR_IF_RANGE] = { "if-range", BLOBMSG_TYPE_STRING },
-	};
 	struct dispatch_handler *d;
-	struct blob_attr *tb[__HDR_MAX];
 	struct path_info *pi;
 
 	pi = uh_path_lookup(cl, url);
@@ -795,18 +2141,18 @@ static bool __handle_file_request(struct client *cl, char *url)
 	if (pi->redirected)
 		return true;
 
-	blobmsg_parse(hdr_policy, __HDR_MAX, tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
-	if (tb[HDR_AUTHORIZATION])
-		pi->auth = blobmsg_data(tb[HDR_AUTHORIZATION]);
+	pi->auth = uh_header(cl, UH_HDR_AUTHORIZATION);
 
 	if (!uh_auth_check(cl, pi))
 		return true;
 
 	d = dispatch_find(url, pi);
-	if (d)
+	if (d) {
 		uh_invoke_handler(cl, d, url, pi);
-	else
-		uh_file_request(cl, url, pi, tb);
+	} else {
+		cl->request.handler = UH_HANDLER_FILE;
+		uh_file_request(cl, url, pi);
+	}
 
 	return true;
 }
@@ -26,23 +26,40 @@
 
 struct listener {
 	struct list_head list;
+	struct list_head blocked_list;
 	struct uloop_fd fd;
 	int socket;
 	int n_clients;
 	struct sockaddr_in6 addr;
+	socklen_t addrlen;
 	bool tls;
 	bool blocked;
+	bool wildcard;
 };
 
 static LIST_HEAD(listeners);
+/* blocked listeners in the order they are given free slots again */
+static LIST_HEAD(blocked);
 static int n_blocked;
 
-void uh_close_listen_fds(void)
+int uh_blocked_listeners(void)
+{
+	return n_blocked;
+}
+
+/* stores the listening sockets in fds unless it is NULL, returns their number */
+int uh_listen_fds(int *fds)
 {
 	struct listener *l;
+	int n = 0;
 
-	list_for_each_entry(l, &listeners, list)
-		close(l->fd.fd);
+	list_for_each_entry(l, &listeners, list) {
+		if (fds)
+			fds[n] = l->fd.fd;
+		n++;
+	}
+
+	return n;
 }
 
 static void uh_block_listener(struct listener *l)
@@ -50,6 +67,12 @@ static void uh_block_listener(struct listener *l)
 	uloop_fd_delete(&l->fd);
 	n_blocked++;
 	l->blocked = true;
+	list_add_tail(&l->blocked_list, &blocked);
+}
+
+static bool uh_listeners_full(void)
+{
+	return conf.max_connections && n_clients >= conf.max_connections;
 }
 
 static void uh_poll_listeners(struct uloop_timeout *timeout)
@@ -60,13 +83,16 @@ static void uh_poll_listeners(struct uloop_timeout *timeout)
 	    n_clients >= conf.max_connections)
 		return;
 
-	list_for_each_entry(l, &listeners, list) {
-		if (!l->blocked)
-			continue;
+	/* a listener that used up the free slots goes to the back of the queue */
+	while (!list_empty(&blocked)) {
+		l = list_first_entry(&blocked, struct listener, blocked_list);
+		list_del(&l->blocked_list);
 
 		l->fd.cb(&l->fd, ULOOP_READ);
-	    if (n_clients >= conf.max_connections)
+		if (uh_listeners_full()) {
+			list_add_tail(&l->blocked_list, &blocked);
 			break;
+		}
 
 		n_blocked--;
 		l->blocked = false;
@@ -86,13 +112,16 @@ void uh_unblock_listeners(void)
 static void listener_cb(struct uloop_fd *fd, unsigned int events)
 {
 	struct listener *l = container_of(fd, struct listener, fd);
+	void *srv_addr = l->wildcard ? NULL : &l->addr;
+	int i;
 
-	while (1) {
-		if (!uh_accept_client(fd->fd, l->tls))
+	/* leave the rest of a burst to the next wakeup, after the clients had a turn */
+	for (i = 0; i < UH_LIMIT_ACCEPT && !uh_listeners_full(); i++) {
+		if (!uh_accept_client(fd->fd, l->tls, srv_addr))
 			break;
 	}
 
-	if (conf.max_connections && n_clients >= conf.max_connections)
+	if (uh_listeners_full() && !l->blocked)
 		uh_block_listener(l);
 }
 
@@ -121,15 +150,101 @@ void uh_setup_listeners(void)
 			setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
 		}
 
+#ifdef linux
+		/* wake up only once the request has arrived */
+		if (conf.tcp_defer_accept > 0)
+			setsockopt(sock, SOL_TCP, TCP_DEFER_ACCEPT, &conf.tcp_defer_accept,
+				   sizeof(conf.tcp_defer_accept));
+
+#ifdef TCP_FASTOPEN
+		if (conf.tcp_fastopen > 0 &&
+		    setsockopt(sock, SOL_TCP, TCP_FASTOPEN, &conf.tcp_fastopen,
+			       sizeof(conf.tcp_fastopen)))
+			perror("setsockopt(TCP_FASTOPEN)");
+#endif
+#endif
+
+		/* the socket was bound before all options were known, a second
+		 * listen() only updates the backlog */
+		if (conf.listen_backlog > 0 && conf.listen_backlog != UH_LIMIT_CLIENTS &&
+		    listen(sock, conf.listen_backlog))
+			perror("listen()");
+
 		l->fd.cb = listener_cb;
 		uloop_fd_add(&l->fd, ULOOP_READ);
 	}
 }
 
+static int uh_socket_open(int family, int type, int protocol,
+			  struct sockaddr *addr, socklen_t addrlen, bool reuseport)
+{
+	int sock;
+	int yes = 1;
+
+	/* get the socket */
+	sock = socket(family, type, protocol);
+	if (sock < 0) {
+		perror("socket()");
+		return -1;
+	}
+
+	/* "address already in use" */
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))) {
+		perror("setsockopt()");
+		goto error;
+	}
+
+#ifdef SO_REUSEPORT
+	/* let the kernel balance connections across worker processes */
+	if (reuseport &&
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))) {
+		perror("setsockopt()");
+		goto error;
+	}
+#endif
+
+	/* required to get parallel v4 + v6 working */
+	if (family == AF_INET6 &&
+	    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) < 0) {
+		perror("setsockopt()");
+		goto error;
+	}
+
+	/* bind */
+	if (bind(sock, addr, addrlen) < 0) {
+		perror("bind()");
+		goto error;
+	}
+
+	/* listen */
+	if (listen(sock, UH_LIMIT_CLIENTS) < 0) {
+		perror("listen()");
+		goto error;
+	}
+
+	fd_cloexec(sock);
+
+	return sock;
+
+error:
+	close(sock);
+	return -1;
+}
+
+static bool uh_addr_wildcard(struct sockaddr *addr)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
+
+	if (addr->sa_family == AF_INET)
+		return sin->sin_addr.s_addr == htonl(INADDR_ANY);
+
+	return IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr);
+}
+
 int uh_socket_bind(const char *host, const char *port, bool tls)
 {
 	int sock = -1;
-	int yes = 1;
 	int status;
 	int bound = 0;
 	struct listener *l = NULL;
@@ -147,55 +262,24 @@ int uh_socket_bind(const char *host, const char *port, bool tls)
 
 	/* try to bind a new socket to each found address */
 	for (p = addrs; p; p = p->ai_next) {
-		/* get the socket */
-		sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (sock < 0) {
-			perror("socket()");
-			goto error;
-		}
-
-		/* "address already in use" */
-		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))) {
-			perror("setsockopt()");
-			goto error;
-		}
-
-		/* required to get parallel v4 + v6 working */
-		if (p->ai_family == AF_INET6 &&
-		    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) < 0) {
-			perror("setsockopt()");
-			goto error;
-		}
-
-		/* bind */
-		if (bind(sock, p->ai_addr, p->ai_addrlen) < 0) {
-			perror("bind()");
-			goto error;
-		}
-
-		/* listen */
-		if (listen(sock, UH_LIMIT_CLIENTS) < 0) {
-			perror("listen()");
-			goto error;
-		}
-
-		fd_cloexec(sock);
+		sock = uh_socket_open(p->ai_family, p->ai_socktype, p->ai_protocol,
+				      p->ai_addr, p->ai_addrlen, false);
+		if (sock < 0)
+			continue;
 
 		l = calloc(1, sizeof(*l));
-		if (!l)
-			goto error;
+		if (!l) {
+			close(sock);
+			continue;
+		}
 
 		l->fd.fd = sock;
 		l->tls = tls;
-		l->addr = *(struct sockaddr_in6 *)p->ai_addr;
+		l->addrlen = min(p->ai_addrlen, sizeof(l->addr));
+		memcpy(&l->addr, p->ai_addr, l->addrlen);
+		l->wildcard = uh_addr_wildcard(p->ai_addr);
 		list_add_tail(&l->list, &listeners);
 		bound++;
-
-		continue;
-
-error:
-		if (sock > -1)
-			close(sock);
 	}
 
 	freeaddrinfo(addrs);
@@ -203,6 +287,31 @@ error:
 	return bound;
 }
 
+/* Replaces every listening socket by a new one bound with SO_REUSEPORT.
+** Each worker process calls this to get sockets of its own, which the
+** kernel then balances incoming connections across. Without SO_REUSEPORT
+** support the inherited sockets are simply shared by all workers. */
+int uh_socket_reuseport(void)
+{
+#ifdef SO_REUSEPORT
+	struct listener *l;
+	int sock;
+
+	list_for_each_entry(l, &listeners, list) {
+		close(l->fd.fd);
+
+		sock = uh_socket_open(l->addr.sin6_family, SOCK_STREAM, 0,
+				      (struct sockaddr *) &l->addr, l->addrlen, true);
+		if (sock < 0)
+			return -1;
+
+		l->fd.fd = sock;
+	}
+#endif
+
+	return 0;
+}
+
 int uh_first_tls_port(int family)
 {
 	struct listener *l;
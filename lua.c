@@ -23,11 +23,18 @@
 #include <lualib.h>
 #include <stdio.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#ifdef linux
+#include <sys/prctl.h>
+#endif
 
 #include "uhttpd.h"
 #include "plugin.h"
 
 #define UH_LUA_CB	"handle_request"
+#define UH_LUA_MSG_SIZE	(64 * 1024)
 
 static const struct uhttpd_ops *ops;
 static struct config *_conf;
@@ -35,6 +42,28 @@ static struct config *_conf;
 
 static lua_State *_L;
 
+struct lua_worker {
+	struct uloop_process proc;
+	struct uloop_fd fd;
+	struct uloop_timeout restart;
+	bool busy;
+};
+
+static struct lua_worker *workers;
+
+enum {
+	LUA_REQ_ENV,
+	LUA_REQ_HEADERS,
+	LUA_REQ_VERSION,
+	__LUA_REQ_MAX,
+};
+
+static const struct blobmsg_policy req_policy[__LUA_REQ_MAX] = {
+	[LUA_REQ_ENV] = { .name = "env", .type = BLOBMSG_TYPE_TABLE },
+	[LUA_REQ_HEADERS] = { .name = "headers", .type = BLOBMSG_TYPE_TABLE },
+	[LUA_REQ_VERSION] = { .name = "version", .type = BLOBMSG_TYPE_INT32 },
+};
+
 static int uh_lua_recv(lua_State *L)
 {
 	static struct pollfd pfd = {
@@ -199,20 +228,16 @@ error:
 	return NULL;
 }
 
-static void lua_main(struct client *cl, struct path_info *pi, char *url)
+static void lua_request_build(struct blob_buf *b, struct client *cl,
+			      struct path_info *pi, char *url)
 {
-	struct blob_attr *cur;
-	const char *error;
 	struct env_var *var;
-	lua_State *L = _L;
 	int path_len, prefix_len;
 	char *str;
-	int rem;
+	void *c;
 
-	lua_getglobal(L, UH_LUA_CB);
-
-	/* new env table for this request */
-	lua_newtable(L);
+	blob_buf_init(b, 0);
+	c = blobmsg_open_table(b, "env");
 
 	prefix_len = strlen(conf.lua_prefix);
 	path_len = strlen(url);
@@ -223,24 +248,52 @@ static void lua_main(struct client *cl, struct path_info *pi, char *url)
 		path_len = str - url;
 	}
 	if (path_len > prefix_len) {
-		lua_pushlstring(L, url + prefix_len,
-				path_len - prefix_len);
-		lua_setfield(L, -2, "PATH_INFO");
+		str = blobmsg_alloc_string_buffer(b, "PATH_INFO", path_len - prefix_len + 1);
+		memcpy(str, url + prefix_len, path_len - prefix_len);
+		str[path_len - prefix_len] = 0;
+		blobmsg_add_string_buffer(b);
 	}
 
 	for (var = ops->get_process_vars(cl, pi); var->name; var++) {
 		if (!var->value)
 			continue;
 
-		lua_pushstring(L, var->value);
-		lua_setfield(L, -2, var->name);
+		blobmsg_add_string(b, var->name, var->value);
+	}
+
+	blobmsg_close_table(b, c);
+
+	blobmsg_add_field(b, BLOBMSG_TYPE_TABLE, "headers",
+			  blob_data(cl->hdr.head), blob_len(cl->hdr.head));
+	blobmsg_add_u32(b, "version", cl->request.version);
+}
+
+static void lua_request_run(lua_State *L, struct blob_attr *msg)
+{
+	struct blob_attr *tb[__LUA_REQ_MAX];
+	struct blob_attr *cur;
+	const char *error;
+	int rem;
+
+	blobmsg_parse(req_policy, __LUA_REQ_MAX, tb, blob_data(msg), blob_len(msg));
+	if (!tb[LUA_REQ_ENV] || !tb[LUA_REQ_HEADERS] || !tb[LUA_REQ_VERSION])
+		return;
+
+	lua_getglobal(L, UH_LUA_CB);
+
+	/* new env table for this request */
+	lua_newtable(L);
+
+	blobmsg_for_each_attr(cur, tb[LUA_REQ_ENV], rem) {
+		lua_pushstring(L, blobmsg_data(cur));
+		lua_setfield(L, -2, blobmsg_name(cur));
 	}
 
-	lua_pushnumber(L, 0.9 + (cl->request.version / 10.0));
+	lua_pushnumber(L, 0.9 + (blobmsg_get_u32(tb[LUA_REQ_VERSION]) / 10.0));
 	lua_setfield(L, -2, "HTTP_VERSION");
 
 	lua_newtable(L);
-	blob_for_each_attr(cur, cl->hdr.head, rem) {
+	blobmsg_for_each_attr(cur, tb[LUA_REQ_HEADERS], rem) {
 		lua_pushstring(L, blobmsg_data(cur));
 		lua_setfield(L, -2, blobmsg_name(cur));
 	}
@@ -255,12 +308,231 @@ static void lua_main(struct client *cl, struct path_info *pi, char *url)
 
 		printf("Status: 500 Internal Server Error\r\n\r\n"
 	       "Unable to launch the requested Lua program:\n"
-	       "  %s: %s\n", pi->phys, error);
+	       "  %s: %s\n", conf.lua_handler, error);
 	}
 
+	lua_settop(L, 0);
+	fflush(stdout);
+}
+
+static void lua_main(struct client *cl, struct path_info *pi, char *url)
+{
+	static struct blob_buf b;
+
+	lua_request_build(&b, cl, pi, url);
+	lua_request_run(_L, b.head);
 	exit(0);
 }
 
+/*
+ * Persistent workers run the handler in a loop, so that modules loaded and
+ * templates compiled by it stay around. Each request arrives as a blobmsg
+ * on a SOCK_SEQPACKET socket, along with the stdin/stdout pipes of the
+ * request. Closing stdout ends the response; a single byte sent back on the
+ * socket tells the server that the worker is idle again.
+ */
+static void lua_worker_main(int sock)
+{
+	static char buf[UH_LUA_MSG_SIZE];
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+	};
+	struct cmsghdr *cmsg;
+	int fds[2];
+	int devnull;
+	ssize_t len;
+
+#ifdef linux
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+
+	devnull = open("/dev/null", O_RDWR);
+	if (devnull < 0)
+		exit(1);
+
+	dup2(devnull, 0);
+	dup2(devnull, 1);
+
+	while (1) {
+		msg.msg_controllen = sizeof(cbuf);
+		len = recvmsg(sock, &msg, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len <= 0)
+			exit(0);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+		    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+			exit(1);
+
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+		dup2(fds[0], 0);
+		dup2(fds[1], 1);
+		close(fds[0]);
+		close(fds[1]);
+
+		if (len >= sizeof(struct blob_attr) &&
+		    blob_pad_len((struct blob_attr *) buf) <= len)
+			lua_request_run(_L, (struct blob_attr *) buf);
+
+		dup2(devnull, 0);
+		dup2(devnull, 1);
+
+		if (write(sock, "", 1) < 0)
+			exit(1);
+	}
+}
+
+static void lua_worker_start(struct lua_worker *w);
+
+static void lua_worker_restart_cb(struct uloop_timeout *t)
+{
+	struct lua_worker *w = container_of(t, struct lua_worker, restart);
+
+	lua_worker_start(w);
+}
+
+static void lua_worker_stop(struct lua_worker *w)
+{
+	if (w->fd.fd >= 0) {
+		uloop_fd_delete(&w->fd);
+		close(w->fd.fd);
+		w->fd.fd = -1;
+	}
+
+	w->busy = true;
+}
+
+static void lua_worker_exit_cb(struct uloop_process *proc, int ret)
+{
+	struct lua_worker *w = container_of(proc, struct lua_worker, proc);
+
+	lua_worker_stop(w);
+	uloop_timeout_set(&w->restart, 1000);
+}
+
+static void lua_worker_ready_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct lua_worker *w = container_of(fd, struct lua_worker, fd);
+	char buf[16];
+	int len;
+
+	len = read(fd->fd, buf, sizeof(buf));
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+
+	/* the exit callback restarts the worker */
+	if (len <= 0) {
+		lua_worker_stop(w);
+		return;
+	}
+
+	w->busy = false;
+}
+
+static void lua_worker_start(struct lua_worker *w)
+{
+	int sv[2];
+	int i, pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv))
+		goto retry;
+
+	pid = fork();
+	if (pid < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		goto retry;
+	}
+
+	if (!pid) {
+		/* keep only our own end, or siblings never see eof */
+		for (i = 0; i < conf.lua_workers; i++)
+			if (workers[i].fd.fd >= 0)
+				close(workers[i].fd.fd);
+
+		close(sv[0]);
+		ops->close_fds();
+		lua_worker_main(sv[1]);
+		exit(0);
+	}
+
+	close(sv[1]);
+	fcntl(sv[0], F_SETFD, fcntl(sv[0], F_GETFD) | FD_CLOEXEC);
+
+	w->fd.fd = sv[0];
+	w->fd.cb = lua_worker_ready_cb;
+	uloop_fd_add(&w->fd, ULOOP_READ);
+
+	w->proc.pid = pid;
+	w->proc.cb = lua_worker_exit_cb;
+	uloop_process_add(&w->proc);
+
+	w->busy = false;
+	return;
+
+retry:
+	uloop_timeout_set(&w->restart, 1000);
+}
+
+static bool lua_worker_dispatch(struct client *cl, struct path_info *pi, char *url)
+{
+	static struct blob_buf b;
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	struct lua_worker *w = NULL;
+	int fds[2];
+	int i;
+
+	for (i = 0; i < conf.lua_workers; i++) {
+		if (!workers[i].busy) {
+			w = &workers[i];
+			break;
+		}
+	}
+
+	if (!w)
+		return false;
+
+	lua_request_build(&b, cl, pi, url);
+	if (blob_pad_len(b.head) > UH_LUA_MSG_SIZE)
+		return false;
+
+	if (!ops->create_pipe_process(cl, w->proc.pid, fds))
+		return false;
+
+	iov.iov_base = b.head;
+	iov.iov_len = blob_pad_len(b.head);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	/* on failure the closed pipes make the relay answer with a 502 */
+	if (sendmsg(w->fd.fd, &msg, MSG_NOSIGNAL) >= 0)
+		w->busy = true;
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return true;
+}
+
 static void lua_handle_request(struct client *cl, char *url, struct path_info *pi)
 {
 	static struct path_info _pi;
@@ -269,6 +541,10 @@ static void lua_handle_request(struct client *cl, char *url, struct path_info *p
 	pi->name = conf.lua_prefix;
 	pi->phys = conf.lua_handler;
 
+	/* fork per request when no persistent worker is idle */
+	if (lua_worker_dispatch(cl, pi, url))
+		return;
+
 	if (!ops->create_process(cl, pi, url, lua_main)) {
 		ops->client_error(cl, 500, "Internal Server Error",
 				  "Failed to create CGI process: %s", strerror(errno));
@@ -282,6 +558,7 @@ static bool check_lua_url(const char *url)
 
 static struct dispatch_handler lua_dispatch = {
 	.script = true,
+	.type = UH_HANDLER_LUA,
 	.check_url = check_lua_url,
 	.handle_request = lua_handle_request,
 };
@@ -295,6 +572,30 @@ static int lua_plugin_init(const struct uhttpd_ops *o, struct config *c)
 	return 0;
 }
 
+static void lua_plugin_post_init(void)
+{
+	int i;
+
+	if (conf.lua_workers <= 0)
+		return;
+
+	workers = calloc(conf.lua_workers, sizeof(*workers));
+	if (!workers) {
+		conf.lua_workers = 0;
+		return;
+	}
+
+	for (i = 0; i < conf.lua_workers; i++) {
+		workers[i].fd.fd = -1;
+		workers[i].busy = true;
+		workers[i].restart.cb = lua_worker_restart_cb;
+	}
+
+	for (i = 0; i < conf.lua_workers; i++)
+		lua_worker_start(&workers[i]);
+}
+
 struct uhttpd_plugin uhttpd_plugin = {
 	.init = lua_plugin_init,
+	.post_init = lua_plugin_post_init,
 };
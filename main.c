@@ -22,12 +22,18 @@
 #define _XOPEN_SOURCE	700
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 
 #include <getopt.h>
 #include <errno.h>
 #include <netdb.h>
 #include <signal.h>
+#include <time.h>
+
+#ifdef linux
+#include <sys/prctl.h>
+#endif
 
 #include <libubox/usock.h>
 
@@ -46,6 +52,113 @@ static int run_server(void)
 	return 0;
 }
 
+static bool workers_stop;
+
+static void uh_workers_signal(int sig)
+{
+	workers_stop = true;
+}
+
+static pid_t uh_worker_start(int idx)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+#ifdef linux
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+	/* the first worker keeps the sockets bound by the supervisor, all
+	 * others join the SO_REUSEPORT group with sockets of their own */
+	if (idx > 0 && uh_socket_reuseport())
+		exit(1);
+
+	if (uh_tls_reinit())
+		exit(1);
+
+	exit(run_server());
+}
+
+static int run_workers(void)
+{
+	struct sigaction sa = { .sa_handler = uh_workers_signal };
+	time_t *started;
+	pid_t *pids;
+	pid_t pid;
+	int i;
+
+	if (uh_socket_reuseport()) {
+		fprintf(stderr, "Error: Unable to rebind sockets for worker processes\n");
+		return 1;
+	}
+
+	/* limits apply to the server as a whole, split them among workers */
+	if (conf.max_connections)
+		conf.max_connections = max(1, conf.max_connections / conf.workers);
+
+	if (conf.max_script_requests)
+		conf.max_script_requests = max(1, conf.max_script_requests / conf.workers);
+
+	if (conf.max_script_queue)
+		conf.max_script_queue = max(1, conf.max_script_queue / conf.workers);
+
+	pids = calloc(conf.workers, sizeof(*pids));
+	started = calloc(conf.workers, sizeof(*started));
+	if (!pids || !started)
+		return 1;
+
+	/* no SA_RESTART, waitpid() has to return when asked to stop */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!workers_stop) {
+		for (i = 0; i < conf.workers; i++) {
+			if (pids[i] > 0)
+				continue;
+
+			/* throttle workers which die right after being started */
+			if (started[i] && time(NULL) - started[i] < 1)
+				sleep(1);
+
+			started[i] = time(NULL);
+			pids[i] = uh_worker_start(i);
+			if (pids[i] < 0) {
+				perror("fork()");
+				pids[i] = 0;
+			}
+		}
+
+		pid = waitpid(-1, NULL, 0);
+		if (pid < 0) {
+			if (errno == ECHILD)
+				sleep(1);
+			continue;
+		}
+
+		for (i = 0; i < conf.workers; i++)
+			if (pids[i] == pid)
+				pids[i] = 0;
+	}
+
+	for (i = 0; i < conf.workers; i++)
+		if (pids[i] > 0)
+			kill(pids[i], SIGTERM);
+
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+
+	free(pids);
+	free(started);
+
+	return 0;
+}
+
 static void uh_config_parse(void)
 {
 	const char *path = conf.file;
@@ -78,6 +191,13 @@ static void uh_config_parse(void)
 				continue;
 
 			uh_index_add(strdup(col1));
+		} else if (!strncmp(line, "M:", 2)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(eol = strchr(col2, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_mime_add(strdup(col1), strdup(col2));
 		} else if (!strncmp(line, "E404:", 5)) {
 			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
 				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
@@ -135,18 +255,35 @@ static int usage(const char *name)
 		"	-C file         ASN.1 server certificate file\n"
 		"	-K file         ASN.1 server private key file\n"
 		"	-q              Redirect all HTTP requests to HTTPS\n"
+		"	-Y seconds      Renew TLS session ticket keys and session cache every given\n"
+		"	                seconds, default is 0 (never)\n"
 #endif
 		"	-h directory    Specify the document root, default is '.'\n"
 		"	-E string       Use given virtual URL as 404 error handler\n"
 		"	-I string       Use given filename as index for directories, multiple allowed\n"
 		"	-S              Do not follow symbolic links outside of the docroot\n"
 		"	-D              Do not allow directory listings, send 403 instead\n"
+		"	-G seconds      Cache rendered directory listings, default is 5, 0 disables\n"
+		"	                (append ?json to a directory URL for a JSON listing)\n"
+		"	-z              Serve precompressed .br/.gz siblings of static files\n"
+		"	-o bytes        Keep small static files in memory, up to bytes in total,\n"
+		"	                default is 0 (disabled)\n"
+		"	-O bytes        Largest file kept in memory, default is 65536\n"
 		"	-R              Enable RFC1918 filter\n"
 		"	-n count        Maximum allowed number of concurrent script requests\n"
+		"	-e count        Maximum number of queued script requests, default is 32,\n"
+		"	                a client may take up half of them\n"
 		"	-N count        Maximum allowed number of concurrent connections\n"
+		"	-b count        Listen backlog, default is 64\n"
+#ifdef linux
+		"	-J seconds      Accept connections only once data arrived (TCP_DEFER_ACCEPT)\n"
+		"	-Q count        Enable TCP Fast Open with the given queue length\n"
+#endif
+		"	-w count        Number of worker processes, default is 1\n"
 #ifdef HAVE_LUA
 		"	-l string       URL prefix for Lua handler, default is '/lua'\n"
 		"	-L file         Lua handler script, omit to disable Lua\n"
+		"	-W count        Number of persistent Lua worker processes, default is 0\n"
 #endif
 #ifdef HAVE_UBUS
 		"	-u string       URL prefix for UBUS via JSON-RPC handler\n"
@@ -156,11 +293,17 @@ static int usage(const char *name)
 #endif
 		"	-x string       URL prefix for CGI handler, default is '/cgi-bin'\n"
 		"	-i .ext=path    Use interpreter at path for files with the given extension\n"
+		"	-F prefix=addr  Pass requests below prefix to a FastCGI backend, multiple allowed\n"
+		"	                (unix socket path or host:port, prepend 'scgi:' for SCGI)\n"
 		"	-t seconds      CGI, Lua and UBUS script timeout in seconds, default is 60\n"
 		"	-T seconds      Network timeout in seconds, default is 30\n"
 		"	-k seconds      HTTP keepalive timeout\n"
+		"	-P seconds      Cache resolved request paths, default is 0 (disabled)\n"
+		"	-M string       URL prefix for server status metrics, disabled by default\n"
+		"	                (Prometheus text format, append /json for JSON)\n"
 		"	-d string       URL decode given string\n"
 		"	-r string       Specify basic auth realm\n"
+		"	-B seconds      Cache verified basic auth credentials, default is 60, 0 disables\n"
 		"	-m string       MD5 crypt given string\n"
 		"\n", name
 	);
@@ -173,7 +316,11 @@ static void init_defaults_pre(void)
 	conf.network_timeout = 30;
 	conf.http_keepalive = 20;
 	conf.max_script_requests = 3;
+	conf.max_script_queue = 32;
 	conf.max_connections = 100;
+	conf.auth_cache_ttl = 60;
+	conf.dirlist_cache_ttl = 5;
+	conf.file_cache_max = 64 * 1024;
 	conf.realm = "Protected Area";
 	conf.cgi_prefix = "/cgi-bin";
 	conf.cgi_path = "/sbin:/usr/sbin:/bin:/usr/bin";
@@ -228,7 +375,7 @@ int main(int argc, char **argv)
 	init_defaults_pre();
 	signal(SIGPIPE, SIG_IGN);
 
-	while ((ch = getopt(argc, argv, "afqSDRXC:K:E:I:p:s:h:c:l:L:d:r:m:n:N:x:i:t:k:T:A:u:U:")) != -1) {
+	while ((ch = getopt(argc, argv, "afqSDRXzC:K:E:I:p:s:h:c:l:L:d:r:m:n:N:w:W:x:i:F:t:k:T:A:u:U:P:B:M:G:o:O:Y:b:J:Q:e:")) != -1) {
 		switch(ch) {
 #ifdef HAVE_TLS
 		case 'C':
@@ -243,6 +390,10 @@ int main(int argc, char **argv)
 			conf.tls_redirect = 1;
 			break;
 
+		case 'Y':
+			conf.tls_rotate = atoi(optarg);
+			break;
+
 		case 's':
 			n_tls++;
 			/* fall through */
@@ -250,6 +401,7 @@ int main(int argc, char **argv)
 		case 'C':
 		case 'K':
 		case 'q':
+		case 'Y':
 		case 's':
 			fprintf(stderr, "uhttpd: TLS support not compiled, "
 			                "ignoring -%c\n", ch);
@@ -295,6 +447,10 @@ int main(int argc, char **argv)
 			conf.no_dirlists = 1;
 			break;
 
+		case 'z':
+			conf.precompressed = 1;
+			break;
+
 		case 'R':
 			conf.rfc1918_filter = 1;
 			break;
@@ -303,10 +459,18 @@ int main(int argc, char **argv)
 			conf.max_script_requests = atoi(optarg);
 			break;
 
+		case 'e':
+			conf.max_script_queue = atoi(optarg);
+			break;
+
 		case 'N':
 			conf.max_connections = atoi(optarg);
 			break;
 
+		case 'w':
+			conf.workers = atoi(optarg);
+			break;
+
 		case 'x':
 			fixup_prefix(optarg);
 			conf.cgi_prefix = optarg;
@@ -325,6 +489,24 @@ int main(int argc, char **argv)
 			uh_interpreter_add(optarg, port);
 			break;
 
+		case 'F':
+			optarg = strdup(optarg);
+			port = strchr(optarg, '=');
+			if (optarg[0] != '/' || !port) {
+				fprintf(stderr, "Error: Invalid FastCGI mapping: %s\n",
+						optarg);
+				exit(1);
+			}
+
+			*port++ = 0;
+			fixup_prefix(optarg);
+			if (uh_fcgi_add(optarg, port)) {
+				fprintf(stderr, "Error: Invalid FastCGI address: %s\n",
+						port);
+				exit(1);
+			}
+			break;
+
 		case 't':
 			conf.script_timeout = atoi(optarg);
 			break;
@@ -337,10 +519,47 @@ int main(int argc, char **argv)
 			conf.http_keepalive = atoi(optarg);
 			break;
 
+		case 'P':
+			conf.path_cache_ttl = atoi(optarg);
+			break;
+
+		case 'B':
+			conf.auth_cache_ttl = atoi(optarg);
+			break;
+
+		case 'G':
+			conf.dirlist_cache_ttl = atoi(optarg);
+			break;
+
+		case 'o':
+			conf.file_cache_size = atoi(optarg);
+			break;
+
+		case 'O':
+			conf.file_cache_max = atoi(optarg);
+			break;
+
+		case 'M':
+			fixup_prefix(optarg);
+			conf.status_prefix = optarg;
+			break;
+
 		case 'A':
 			conf.tcp_keepalive = atoi(optarg);
 			break;
 
+		case 'b':
+			conf.listen_backlog = atoi(optarg);
+			break;
+
+		case 'J':
+			conf.tcp_defer_accept = atoi(optarg);
+			break;
+
+		case 'Q':
+			conf.tcp_fastopen = atoi(optarg);
+			break;
+
 		case 'f':
 			nofork = 1;
 			break;
@@ -390,9 +609,14 @@ int main(int argc, char **argv)
 		case 'L':
 			conf.lua_handler = optarg;
 			break;
+
+		case 'W':
+			conf.lua_workers = atoi(optarg);
+			break;
 #else
 		case 'l':
 		case 'L':
+		case 'W':
 			fprintf(stderr, "uhttpd: Lua support not compiled, "
 			                "ignoring -%c\n", ch);
 			break;
@@ -438,6 +662,7 @@ int main(int argc, char **argv)
 	}
 
 	init_defaults_post();
+	uh_metrics_init();
 
 	if (!bound) {
 		fprintf(stderr, "Error: No sockets bound, unable to continue\n");
@@ -498,5 +723,8 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (conf.workers > 1)
+		return run_workers();
+
 	return run_server();
 }
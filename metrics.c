@@ -0,0 +1,281 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+#include "uhttpd.h"
+
+struct uh_metrics uh_metrics;
+
+/* upper bounds of the histogram buckets in microseconds */
+static const uint64_t bucket_bounds[UH_METRIC_BUCKETS] = {
+	1000, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+static const char * const handler_names[__UH_HANDLER_MAX] = {
+	[UH_HANDLER_OTHER] = "other",
+	[UH_HANDLER_FILE] = "file",
+	[UH_HANDLER_CGI] = "cgi",
+	[UH_HANDLER_LUA] = "lua",
+	[UH_HANDLER_UBUS] = "ubus",
+	[UH_HANDLER_FCGI] = "fcgi",
+	[UH_HANDLER_STATUS] = "status",
+};
+
+static const char * const timing_names[__UH_TIMING_MAX] = {
+	[UH_TIMING_RELAY] = "relay",
+	[UH_TIMING_UBUS_CALL] = "ubus_call",
+};
+
+uint64_t uh_metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void uh_histogram_observe(struct uh_histogram *h, uint64_t start)
+{
+	uint64_t us = uh_metrics_now() - start;
+	int i;
+
+	h->count++;
+	h->sum_us += us;
+
+	for (i = 0; i < UH_METRIC_BUCKETS; i++) {
+		if (us <= bucket_bounds[i]) {
+			h->buckets[i]++;
+			break;
+		}
+	}
+}
+
+void uh_metrics_timing(enum uh_timing type, uint64_t start)
+{
+	if (start)
+		uh_histogram_observe(&uh_metrics.timings[type], start);
+}
+
+void uh_metrics_request_done(struct client *cl)
+{
+	struct http_request *r = &cl->request;
+	int class = cl->http_code / 100;
+
+	if (!r->start)
+		return;
+
+	uh_histogram_observe(&uh_metrics.requests[r->handler], r->start);
+
+	if (class >= 1 && class <= 5)
+		uh_metrics.responses[class - 1]++;
+
+	r->start = 0;
+}
+
+/* the report goes out in a few large chunks instead of one per line */
+static struct {
+	struct client *cl;
+	int len;
+	char data[2048];
+} out;
+
+static void __printf(1, 2) status_printf(const char *format, ...)
+{
+	va_list arg;
+	int len;
+
+	va_start(arg, format);
+	len = vsnprintf(out.data + out.len, sizeof(out.data) - out.len, format, arg);
+	va_end(arg);
+
+	if (out.len + len < sizeof(out.data)) {
+		out.len += len;
+		return;
+	}
+
+	uh_chunk_write(out.cl, out.data, out.len);
+	out.len = 0;
+
+	va_start(arg, format);
+	len = vsnprintf(out.data, sizeof(out.data), format, arg);
+	va_end(arg);
+
+	out.len = min(len, (int) sizeof(out.data) - 1);
+}
+
+static void status_flush(void)
+{
+	if (out.len)
+		uh_chunk_write(out.cl, out.data, out.len);
+
+	out.len = 0;
+}
+
+static void status_prom_histogram(const char *metric, const char *label,
+				  const char *value, struct uh_histogram *h)
+{
+	const char *sep = label ? "," : "";
+	uint64_t count = 0;
+	char lbl[64] = "";
+	int i;
+
+	if (label)
+		snprintf(lbl, sizeof(lbl), "%s=\"%s\"", label, value);
+
+	for (i = 0; i < UH_METRIC_BUCKETS; i++) {
+		count += h->buckets[i];
+		status_printf("%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n",
+			      metric, lbl, sep, bucket_bounds[i] / 1e6, count);
+	}
+
+	status_printf("%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", metric, lbl, sep, h->count);
+	status_printf("%s_sum%s%s%s %g\n", metric, label ? "{" : "", lbl, label ? "}" : "",
+		      h->sum_us / 1e6);
+	status_printf("%s_count%s%s%s %" PRIu64 "\n", metric, label ? "{" : "", lbl,
+		      label ? "}" : "", h->count);
+}
+
+static void status_prometheus(int running, int queued)
+{
+	int i;
+
+	status_printf("# TYPE uhttpd_connections_total counter\n"
+		      "uhttpd_connections_total %" PRIu64 "\n", uh_metrics.connections);
+	status_printf("# TYPE uhttpd_clients gauge\nuhttpd_clients %d\n", n_clients);
+	status_printf("# TYPE uhttpd_script_requests_running gauge\n"
+		      "uhttpd_script_requests_running %d\n", running);
+	status_printf("# TYPE uhttpd_script_requests_queued gauge\n"
+		      "uhttpd_script_requests_queued %d\n", queued);
+	status_printf("# TYPE uhttpd_listeners_blocked gauge\n"
+		      "uhttpd_listeners_blocked %d\n", uh_blocked_listeners());
+	status_printf("# TYPE uhttpd_received_bytes_total counter\n"
+		      "uhttpd_received_bytes_total %" PRIu64 "\n", uh_metrics.bytes_in);
+	status_printf("# TYPE uhttpd_sent_bytes_total counter\n"
+		      "uhttpd_sent_bytes_total %" PRIu64 "\n", uh_metrics.bytes_out);
+
+	status_printf("# TYPE uhttpd_responses_total counter\n");
+	for (i = 0; i < ARRAY_SIZE(uh_metrics.responses); i++)
+		status_printf("uhttpd_responses_total{code=\"%dxx\"} %" PRIu64 "\n",
+			      i + 1, uh_metrics.responses[i]);
+
+	status_printf("# TYPE uhttpd_request_duration_seconds histogram\n");
+	for (i = 0; i < __UH_HANDLER_MAX; i++)
+		status_prom_histogram("uhttpd_request_duration_seconds", "handler",
+				      handler_names[i], &uh_metrics.requests[i]);
+
+	for (i = 0; i < __UH_TIMING_MAX; i++) {
+		char metric[64];
+
+		snprintf(metric, sizeof(metric), "uhttpd_%s_duration_seconds", timing_names[i]);
+		status_printf("# TYPE %s histogram\n", metric);
+		status_prom_histogram(metric, NULL, NULL, &uh_metrics.timings[i]);
+	}
+}
+
+static void status_json_histogram(const char *name, struct uh_histogram *h, bool last)
+{
+	uint64_t count = 0;
+	int i;
+
+	status_printf("\"%s\":{\"count\":%" PRIu64 ",\"sum\":%g,\"buckets\":{",
+		      name, h->count, h->sum_us / 1e6);
+
+	for (i = 0; i < UH_METRIC_BUCKETS; i++) {
+		count += h->buckets[i];
+		status_printf("\"%g\":%" PRIu64 ",", bucket_bounds[i] / 1e6, count);
+	}
+
+	status_printf("\"+Inf\":%" PRIu64 "}}%s", h->count, last ? "" : ",");
+}
+
+static void status_json(int running, int queued)
+{
+	int i;
+
+	status_printf("{\"connections\":%" PRIu64 ",\"clients\":%d,"
+		      "\"script_requests\":{\"running\":%d,\"queued\":%d},"
+		      "\"listeners_blocked\":%d,"
+		      "\"bytes\":{\"received\":%" PRIu64 ",\"sent\":%" PRIu64 "},",
+		      uh_metrics.connections, n_clients, running, queued,
+		      uh_blocked_listeners(), uh_metrics.bytes_in, uh_metrics.bytes_out);
+
+	status_printf("\"responses\":{");
+	for (i = 0; i < ARRAY_SIZE(uh_metrics.responses); i++)
+		status_printf("\"%dxx\":%" PRIu64 "%s", i + 1, uh_metrics.responses[i],
+			      i + 1 < ARRAY_SIZE(uh_metrics.responses) ? "," : "");
+
+	status_printf("},\"requests\":{");
+	for (i = 0; i < __UH_HANDLER_MAX; i++)
+		status_json_histogram(handler_names[i], &uh_metrics.requests[i],
+				      i + 1 == __UH_HANDLER_MAX);
+
+	status_printf("},\"timings\":{");
+	for (i = 0; i < __UH_TIMING_MAX; i++)
+		status_json_histogram(timing_names[i], &uh_metrics.timings[i],
+				      i + 1 == __UH_TIMING_MAX);
+
+	status_printf("}}\n");
+}
+
+static bool status_check_url(const char *url)
+{
+	return uh_path_match(conf.status_prefix, url);
+}
+
+static void status_handle_request(struct client *cl, char *url, struct path_info *pi)
+{
+	const char *fmt = url + strlen(conf.status_prefix);
+	bool json = !strcmp(fmt, "/json") || !strcmp(fmt, "?json");
+	int running, queued;
+
+	uh_script_requests(&running, &queued);
+
+	uh_http_header(cl, 200, "OK");
+	uh_response_printf(cl, "Content-Type: %s\r\n\r\n",
+			   json ? "application/json" : "text/plain; version=0.0.4");
+
+	if (cl->request.method == UH_HTTP_MSG_HEAD)
+		return uh_request_done(cl);
+
+	out.cl = cl;
+	out.len = 0;
+
+	if (json)
+		status_json(running, queued);
+	else
+		status_prometheus(running, queued);
+
+	status_flush();
+	uh_request_done(cl);
+}
+
+static struct dispatch_handler status_dispatch = {
+	.type = UH_HANDLER_STATUS,
+	.check_url = status_check_url,
+	.handle_request = status_handle_request,
+};
+
+void uh_metrics_init(void)
+{
+	if (conf.status_prefix)
+		uh_dispatch_add(&status_dispatch);
+}
@@ -0,0 +1,79 @@
+/*
+ * uhttpd-microbench - timings of single hot-path functions
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* the JSON encoder is static, so the plugin is built into this unit */
+#include "ubus.c"
+
+#include "microbench.h"
+
+static void mb_json_chunk(struct client *cl, const void *data, int len)
+{
+	mb_sink += len;
+}
+
+static const struct uhttpd_ops mb_ops = {
+	.chunk_write = mb_json_chunk,
+};
+
+/* roughly the size and shape of a network.interface dump reply */
+static void mb_json_reply(struct blob_buf *b)
+{
+	void *a, *t, *r;
+	int i;
+
+	blob_buf_init(b, 0);
+	a = blobmsg_open_array(b, "interface");
+
+	for (i = 0; i < 8; i++) {
+		t = blobmsg_open_table(b, NULL);
+		blobmsg_add_string(b, "interface", "lan");
+		blobmsg_add_u8(b, "up", 1);
+		blobmsg_add_u32(b, "uptime", 123456 + i);
+		blobmsg_add_string(b, "l3_device", "br-lan");
+		blobmsg_add_string(b, "proto", "static");
+		blobmsg_add_string(b, "device", "eth0 \"bridge\"\n");
+
+		r = blobmsg_open_array(b, "ipv4-address");
+		blobmsg_add_string(b, NULL, "192.168.1.1");
+		blobmsg_add_string(b, NULL, "10.0.0.1");
+		blobmsg_close_array(b, r);
+
+		blobmsg_close_table(b, t);
+	}
+
+	blobmsg_close_array(b, a);
+}
+
+void mb_ubus_json(long n)
+{
+	static struct blob_buf b;
+	struct client cl = {};
+	uint64_t start;
+	long i;
+
+	ops = &mb_ops;
+	mb_json_reply(&b);
+
+	start = mb_now();
+	for (i = 0; i < n; i++)
+		uh_ubus_send_json(&cl, "", b.head);
+
+	mb_report("ubus_json", n, start);
+	blob_buf_free(&b);
+}
@@ -0,0 +1,198 @@
+/*
+ * uhttpd-microbench - timings of single hot-path functions
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "uhttpd.h"
+#include "microbench.h"
+
+/* normally provided by main.c, which is left out of this binary */
+char uh_buf[4096];
+
+volatile unsigned int mb_sink;
+
+uint64_t mb_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void mb_report(const char *name, long n, uint64_t start)
+{
+	uint64_t ns = mb_now() - start;
+
+	printf("%-16s %10ld ops %10.1f ns/op\n", name, n, (double) ns / n);
+}
+
+static void mb_urldecode(long n)
+{
+	static const char src[] = "/cgi-bin/luci/admin/status%2Foverview?q=a%20b%26c&x=%E2%82%AC";
+	uint64_t start;
+	char buf[128];
+	long i;
+
+	start = mb_now();
+	for (i = 0; i < n; i++)
+		mb_sink += uh_urldecode(buf, sizeof(buf) - 1, src, sizeof(src) - 1);
+
+	mb_report("urldecode", n, start);
+}
+
+static void mb_mime_lookup(long n)
+{
+	static const char * const paths[] = {
+		"/www/index.html",
+		"/www/luci-static/resources/cbi.js",
+		"/www/luci-static/bootstrap/cascade.css",
+		"/www/luci-static/resources/icons/loading.svg",
+		"/tmp/backup-OpenWrt-2013.tar.gz",
+		"/www/README",
+	};
+	uint64_t start;
+	long i;
+
+	/* the first call builds the sorted table */
+	uh_file_mime_lookup(paths[0]);
+
+	start = mb_now();
+	for (i = 0; i < n; i++)
+		mb_sink += *uh_file_mime_lookup(paths[i % ARRAY_SIZE(paths)]);
+
+	mb_report("mime_lookup", n, start);
+}
+
+static void mb_header_lookup(long n)
+{
+	static const char * const names[] = {
+		"host", "user-agent", "accept", "accept-encoding",
+		"cookie", "if-none-match", "x-requested-with",
+	};
+	int len[ARRAY_SIZE(names)];
+	uint64_t start;
+	long i;
+
+	for (i = 0; i < ARRAY_SIZE(names); i++)
+		len[i] = strlen(names[i]);
+
+	start = mb_now();
+	for (i = 0; i < n; i++)
+		mb_sink += uh_header_lookup(names[i % ARRAY_SIZE(names)],
+					    len[i % ARRAY_SIZE(names)]);
+
+	mb_report("header_lookup", n, start);
+}
+
+static int mb_stream_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	mb_sink += len;
+	return len;
+}
+
+/* a client without a socket, its stream swallows everything written */
+static void mb_chunk_write(long n)
+{
+	static struct ustream us;
+	struct client cl = {};
+	uint64_t start;
+	long i;
+
+	us.write = mb_stream_write;
+	ustream_init_defaults(&us);
+	cl.us = &us;
+	cl.request.respond_chunked = true;
+
+	start = mb_now();
+	for (i = 0; i < n; i++)
+		uh_chunk_write(&cl, uh_buf, 1024);
+
+	uh_response_flush(&cl);
+	mb_report("chunk_write", n, start);
+
+	uloop_timeout_cancel(&cl.timeout);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(long n);
+} benches[] = {
+	{ "urldecode", mb_urldecode },
+	{ "mime_lookup", mb_mime_lookup },
+	{ "header_lookup", mb_header_lookup },
+	{ "chunk_write", mb_chunk_write },
+#ifdef HAVE_UBUS
+	{ "ubus_json", mb_ubus_json },
+#endif
+};
+
+static int usage(const char *name)
+{
+	int i;
+
+	fprintf(stderr,
+		"Usage: %s [options] [benchmark ...]\n"
+		"	-n count        Iterations per benchmark, default is 1000000\n"
+		"\n"
+		"Benchmarks:", name);
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, " %s", benches[i].name);
+
+	fprintf(stderr, "\n");
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	long n = 1000000;
+	int ch, i, j;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = atol(optarg);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (n < 1)
+		return usage(argv[0]);
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		if (optind < argc) {
+			for (j = optind; j < argc; j++)
+				if (!strcmp(argv[j], benches[i].name))
+					break;
+
+			if (j == argc)
+				continue;
+		}
+
+		benches[i].run(n);
+	}
+
+	return 0;
+}
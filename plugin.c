@@ -28,11 +28,17 @@ static const struct uhttpd_ops ops = {
 	.path_match = uh_path_match,
 	.create_process = uh_create_process,
 	.get_process_vars = uh_get_process_vars,
+	.create_pipe_process = uh_create_pipe_process,
+	.close_fds = uh_close_fds,
 	.http_header = uh_http_header,
 	.client_error = uh_client_error,
 	.request_done = uh_request_done,
 	.chunk_write = uh_chunk_write,
 	.chunk_printf = uh_chunk_printf,
+	.response_printf = uh_response_printf,
+	.response_flush = uh_response_flush,
+	.metrics_now = uh_metrics_now,
+	.metrics_timing = uh_metrics_timing,
 	.urlencode = uh_urlencode,
 	.urldecode = uh_urldecode,
 };
@@ -26,12 +26,19 @@ struct uhttpd_ops {
 	bool (*create_process)(struct client *cl, struct path_info *pi, char *url,
 			       void (*cb)(struct client *cl, struct path_info *pi, char *url));
 	struct env_var *(*get_process_vars)(struct client *cl, struct path_info *pi);
+	bool (*create_pipe_process)(struct client *cl, int pid, int fds[2]);
+	void (*close_fds)(void);
 
 	void (*http_header)(struct client *cl, int code, const char *summary);
 	void (*client_error)(struct client *cl, int code, const char *summary, const char *fmt, ...);
 	void (*request_done)(struct client *cl);
 	void (*chunk_write)(struct client *cl, const void *data, int len);
 	void (*chunk_printf)(struct client *cl, const char *format, ...);
+	void (*response_printf)(struct client *cl, const char *format, ...);
+	void (*response_flush)(struct client *cl);
+
+	uint64_t (*metrics_now)(void);
+	void (*metrics_timing)(enum uh_timing type, uint64_t start);
 
 	int (*urlencode)(char *buf, int blen, const char *src, int slen);
 	int (*urldecode)(char *buf, int blen, const char *src, int slen);
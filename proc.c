@@ -17,53 +17,31 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <signal.h>
 #include <libubox/blobmsg.h>
 #include "uhttpd.h"
 
-#define __headers \
-	__header(accept, accept) \
-	__header(accept_charset, accept-charset) \
-	__header(accept_encoding, accept-encoding) \
-	__header(accept_language, accept-language) \
-	__header(authorization, authorization) \
-	__header(connection, connection) \
-	__header(cookie, cookie) \
-	__header(host, host) \
-	__header(referer, referer) \
-	__header(user_agent, user-agent) \
-	__header(content_type, content-type) \
-	__header(content_length, content-length)
-
-#undef __header
-#define __header __enum_header
-enum client_hdr {
-	__headers
-	__HDR_MAX,
-};
-
-#undef __header
-#define __header __blobmsg_header
-static const struct blobmsg_policy hdr_policy[__HDR_MAX] = {
-	__headers
-};
-
 static const struct {
 	const char *name;
 	int idx;
 } proc_header_env[] = {
-	{ "HTTP_ACCEPT", HDR_accept },
-	{ "HTTP_ACCEPT_CHARSET", HDR_accept_charset },
-	{ "HTTP_ACCEPT_ENCODING", HDR_accept_encoding },
-	{ "HTTP_ACCEPT_LANGUAGE", HDR_accept_language },
-	{ "HTTP_AUTHORIZATION", HDR_authorization },
-	{ "HTTP_CONNECTION", HDR_connection },
-	{ "HTTP_COOKIE", HDR_cookie },
-	{ "HTTP_HOST", HDR_host },
-	{ "HTTP_REFERER", HDR_referer },
-	{ "HTTP_USER_AGENT", HDR_user_agent },
-	{ "CONTENT_TYPE", HDR_content_type },
-	{ "CONTENT_LENGTH", HDR_content_length },
+	{ "HTTP_ACCEPT", UH_HDR_ACCEPT },
+	{ "HTTP_ACCEPT_CHARSET", UH_HDR_ACCEPT_CHARSET },
+	{ "HTTP_ACCEPT_ENCODING", UH_HDR_ACCEPT_ENCODING },
+	{ "HTTP_ACCEPT_LANGUAGE", UH_HDR_ACCEPT_LANGUAGE },
+	{ "HTTP_AUTHORIZATION", UH_HDR_AUTHORIZATION },
+	{ "HTTP_CONNECTION", UH_HDR_CONNECTION },
+	{ "HTTP_COOKIE", UH_HDR_COOKIE },
+	{ "HTTP_HOST", UH_HDR_HOST },
+	{ "HTTP_REFERER", UH_HDR_REFERER },
+	{ "HTTP_USER_AGENT", UH_HDR_USER_AGENT },
+	{ "CONTENT_TYPE", UH_HDR_CONTENT_TYPE },
+	{ "CONTENT_LENGTH", UH_HDR_CONTENT_LENGTH },
 };
 
 enum extra_vars {
@@ -122,9 +100,7 @@ static struct env_var extra_vars[] = {
 struct env_var *uh_get_process_vars(struct client *cl, struct path_info *pi)
 {
 	struct http_request *req = &cl->request;
-	struct blob_attr *data = cl->hdr.head;
 	struct env_var *vars = (void *) uh_buf;
-	struct blob_attr *tb[__HDR_MAX];
 	const char *url;
 	int len;
 	int i;
@@ -154,13 +130,11 @@ struct env_var *uh_get_process_vars(struct client *cl, struct path_info *pi)
 	inet_ntop(cl->peer_addr.family, &cl->peer_addr.in, remote_addr, sizeof(remote_addr));
 	snprintf(remote_port, sizeof(remote_port), "%d", cl->peer_addr.port);
 
-	blobmsg_parse(hdr_policy, __HDR_MAX, tb, blob_data(data), blob_len(data));
 	for (i = 0; i < ARRAY_SIZE(proc_header_env); i++) {
-		struct blob_attr *cur;
+		const char *val = uh_header(cl, proc_header_env[i].idx);
 
-		cur = tb[proc_header_env[i].idx];
 		vars[i].name = proc_header_env[i].name;
-		vars[i].value = cur ? blobmsg_data(cur) : "";
+		vars[i].value = val ? val : "";
 	}
 
 	memcpy(&vars[i], extra_vars, sizeof(extra_vars));
@@ -171,13 +145,22 @@ struct env_var *uh_get_process_vars(struct client *cl, struct path_info *pi)
 	return vars;
 }
 
-static void proc_close_fds(struct client *cl)
+static int proc_child_fds(struct client *cl, int *fds)
 {
 	struct dispatch_proc *p = &cl->dispatch.proc;
+	int n = 0;
 
-	close(p->r.sfd.fd.fd);
+	fds[n++] = p->r.sfd.fd.fd;
 	if (p->wrfd.fd >= 0)
-		close(p->wrfd.fd);
+		fds[n++] = p->wrfd.fd;
+
+	/* forked Lua children do not exec, so cloexec does not cover these */
+	if (p->r.splicing) {
+		fds[n++] = p->r.splice_rd.fd;
+		fds[n++] = p->r.splice_wr.fd;
+	}
+
+	return n;
 }
 
 static void proc_handle_close(struct relay *r, int ret)
@@ -211,9 +194,33 @@ static void proc_handle_header(struct relay *r, const char *name, const char *va
 		return;
 	}
 
+	/* already sent by uh_http_header() */
+	if (!strcasecmp(name, "Date"))
+		return;
+
 	blobmsg_add_string(&cl->dispatch.proc.hdr, name, val);
 }
 
+static int64_t proc_content_length(struct dispatch_proc *p)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blob_for_each_attr(cur, p->hdr.head, rem)
+		if (!strcasecmp(blobmsg_name(cur), "Content-Length"))
+			return strtoll(blobmsg_get_string(cur), NULL, 10);
+
+	return -1;
+}
+
+/* larger pipes mean fewer wakeups per request and bigger splices */
+static void proc_pipe_size(int fd)
+{
+#ifdef F_SETPIPE_SZ
+	fcntl(fd, F_SETPIPE_SZ, UH_PIPE_SIZE);
+#endif
+}
+
 static void proc_handle_header_end(struct relay *r)
 {
 	struct client *cl = r->cl;
@@ -222,11 +229,28 @@ static void proc_handle_header_end(struct relay *r)
 	int rem;
 
 	uloop_timeout_cancel(&p->timeout);
+
+	/*
+	 * Plain responses bypass the ustreams and are spliced from the pipe to
+	 * the socket. A large one with a known length is sent without chunked
+	 * encoding for that; closing the connection afterwards means a script
+	 * sending more or less than it announced cannot desync the client.
+	 */
+	if (!cl->tls && cl->request.method != UH_HTTP_MSG_HEAD) {
+		if (cl->request.respond_chunked && proc_content_length(p) >= UH_SPLICE_MIN) {
+			cl->request.respond_chunked = false;
+			cl->request.connection_close = true;
+		}
+
+		r->splice = !cl->request.respond_chunked;
+	}
+
 	uh_http_header(cl, cl->dispatch.proc.status_code, cl->dispatch.proc.status_msg);
 	blob_for_each_attr(cur, cl->dispatch.proc.hdr.head, rem)
-		ustream_printf(cl->us, "%s: %s\r\n", blobmsg_name(cur), blobmsg_data(cur));
+		uh_response_printf(cl, "%s: %s\r\n", blobmsg_name(cur), blobmsg_get_string(cur));
 
-	ustream_printf(cl->us, "\r\n");
+	uh_response_printf(cl, "\r\n");
+	uh_response_flush(cl);
 
 	if (cl->request.method == UH_HTTP_MSG_HEAD)
 		r->skip_data = true;
@@ -316,6 +340,28 @@ static void proc_timeout_cb(struct uloop_timeout *timeout)
 	uh_relay_kill(cl, &proc->r);
 }
 
+static void proc_attach(struct client *cl, int rfd, int wfd, int pid)
+{
+	struct dispatch *d = &cl->dispatch;
+	struct dispatch_proc *proc = &d->proc;
+
+	proc->wrfd.fd = wfd;
+	uh_relay_open(cl, &proc->r, rfd, pid);
+
+	d->free = proc_free;
+	d->child_fds = proc_child_fds;
+	d->data_send = proc_data_send;
+	d->data_done = proc_write_close;
+	d->write_cb = proc_relay_write_cb;
+	proc->r.header_cb = proc_handle_header;
+	proc->r.header_end = proc_handle_header_end;
+	proc->r.close = proc_handle_close;
+	proc->wrfd.cb = proc_write_cb;
+	proc->timeout.cb = proc_timeout_cb;
+	if (conf.script_timeout > 0)
+		uloop_timeout_set(&proc->timeout, conf.script_timeout * 1000);
+}
+
 bool uh_create_process(struct client *cl, struct path_info *pi, char *url,
 		       void (*cb)(struct client *cl, struct path_info *pi, char *url))
 {
@@ -358,30 +404,151 @@ bool uh_create_process(struct client *cl, struct path_info *pi, char *url,
 	close(rfd[1]);
 	close(wfd[0]);
 
-	proc->wrfd.fd = wfd[1];
-	uh_relay_open(cl, &proc->r, rfd[0], pid);
+	proc_pipe_size(rfd[0]);
+	proc_pipe_size(wfd[1]);
+	proc_attach(cl, rfd[0], wfd[1], pid);
 
-	d->free = proc_free;
-	d->close_fds = proc_close_fds;
-	d->data_send = proc_data_send;
-	d->data_done = proc_write_close;
-	d->write_cb = proc_relay_write_cb;
-	proc->r.header_cb = proc_handle_header;
-	proc->r.header_end = proc_handle_header_end;
-	proc->r.close = proc_handle_close;
-	proc->wrfd.cb = proc_write_cb;
-	proc->timeout.cb = proc_timeout_cb;
-	if (conf.script_timeout > 0)
-		uloop_timeout_set(&proc->timeout, conf.script_timeout * 1000);
+	return true;
+
+close_wfd:
+	close(wfd[0]);
+	close(wfd[1]);
+close_rfd:
+	close(rfd[0]);
+	close(rfd[1]);
+
+	return false;
+}
+
+/*
+ * Launches argv[0] in dir through vfork() and execve(), so that unlike
+ * with uh_create_process() the address space of the server is never
+ * copied. Everything the child needs is prepared by the caller; it only
+ * rearranges descriptors and signals before exec. If the exec fails,
+ * false is returned with errno set accordingly.
+ */
+bool uh_spawn_process(struct client *cl, const char *dir,
+		      char *const argv[], char *const envp[])
+{
+	struct dispatch_proc *proc = &cl->dispatch.proc;
+	static const int reset_signals[] = { SIGINT, SIGTERM, SIGCHLD };
+	volatile int exec_errno = 0;
+	sigset_t set, oldset;
+	int rfd[2], wfd[2];
+	int *fds, n_fds;
+	int i, pid;
+
+	blob_buf_init(&proc->hdr, 0);
+	proc->status_code = 200;
+	proc->status_msg = "OK";
+
+	if (pipe(rfd))
+		return false;
+
+	if (pipe(wfd))
+		goto close_rfd;
+
+	for (i = 0; i < 2; i++) {
+		fd_cloexec(rfd[i]);
+		fd_cloexec(wfd[i]);
+	}
+
+	/* the child shares our memory, so it must not run any client hooks */
+	fds = uh_child_fds(&n_fds);
+	if (!fds)
+		goto close_wfd;
+
+	/* keep our handlers from running in the child before exec */
+	sigfillset(&set);
+	sigprocmask(SIG_SETMASK, &set, &oldset);
+
+	pid = vfork();
+	if (!pid) {
+		dup2(rfd[1], 1);
+		dup2(wfd[0], 0);
+
+		for (i = 0; i < n_fds; i++)
+			close(fds[i]);
+
+		for (i = 0; i < ARRAY_SIZE(reset_signals); i++)
+			signal(reset_signals[i], SIG_DFL);
+
+		sigprocmask(SIG_SETMASK, &oldset, NULL);
+
+		if (!chdir(dir))
+			execve(argv[0], argv, envp);
+
+		exec_errno = errno;
+		_exit(127);
+	}
+
+	sigprocmask(SIG_SETMASK, &oldset, NULL);
+	free(fds);
+
+	if (pid < 0)
+		goto close_wfd;
+
+	if (exec_errno) {
+		waitpid(pid, NULL, 0);
+		errno = exec_errno;
+		goto close_wfd;
+	}
+
+	close(rfd[1]);
+	close(wfd[0]);
+
+	proc_pipe_size(rfd[0]);
+	proc_pipe_size(wfd[1]);
+	proc_attach(cl, rfd[0], wfd[1], pid);
 
 	return true;
 
 close_wfd:
+	i = errno;
 	close(wfd[0]);
 	close(wfd[1]);
+	errno = i;
 close_rfd:
+	i = errno;
 	close(rfd[0]);
 	close(rfd[1]);
+	errno = i;
 
 	return false;
 }
+
+/*
+ * Like uh_create_process(), but for a process which is already running
+ * and outlives the request. The caller hands fds[0] (stdin) and fds[1]
+ * (stdout) over to that process and closes its own copies; the response
+ * ends once the process closes its stdout. The pid is only killed when
+ * the script timeout expires.
+ */
+bool uh_create_pipe_process(struct client *cl, int pid, int fds[2])
+{
+	struct dispatch_proc *proc = &cl->dispatch.proc;
+	int rfd[2], wfd[2];
+
+	blob_buf_init(&proc->hdr, 0);
+	proc->status_code = 200;
+	proc->status_msg = "OK";
+
+	if (pipe(rfd))
+		return false;
+
+	if (pipe(wfd)) {
+		close(rfd[0]);
+		close(rfd[1]);
+		return false;
+	}
+
+	fds[0] = wfd[0];
+	fds[1] = rfd[1];
+
+	proc_pipe_size(rfd[0]);
+	proc_pipe_size(wfd[1]);
+	proc_attach(cl, rfd[0], wfd[1], 0);
+	proc->r.proc.pid = pid;
+
+	return true;
+}
@@ -17,9 +17,26 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <fcntl.h>
 #include <signal.h>
 #include "uhttpd.h"
 
+#define UH_SPLICE_CHUNK	(64 * 1024)
+
+static void relay_splice_stop(struct relay *r)
+{
+	if (!r->splicing)
+		return;
+
+	uloop_fd_delete(&r->splice_rd);
+	uloop_fd_delete(&r->splice_wr);
+	close(r->splice_rd.fd);
+	close(r->splice_wr.fd);
+	r->splicing = false;
+}
+
 void uh_relay_free(struct relay *r)
 {
 	if (!r->cl)
@@ -28,6 +45,7 @@ void uh_relay_free(struct relay *r)
 	if (r->proc.pending)
 		kill(r->proc.pid, SIGKILL);
 
+	relay_splice_stop(r);
 	uloop_timeout_cancel(&r->timeout);
 	uloop_process_delete(&r->proc);
 	ustream_free(&r->sfd.stream);
@@ -47,6 +65,9 @@ void uh_relay_close(struct relay *r, int ret)
 	us->notify_write = NULL;
 	us->notify_state = NULL;
 
+	uh_metrics_timing(UH_TIMING_RELAY, r->start);
+	r->start = 0;
+
 	if (r->close)
 		r->close(r, ret);
 }
@@ -109,6 +130,122 @@ static void relay_process_headers(struct relay *r)
 	}
 }
 
+#ifdef linux
+static void relay_splice(struct relay *r);
+
+static void relay_splice_rd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	relay_splice(container_of(fd, struct relay, splice_rd));
+}
+
+static void relay_splice_wr_cb(struct uloop_fd *fd, unsigned int events)
+{
+	relay_splice(container_of(fd, struct relay, splice_wr));
+}
+
+/* The pipe and the socket are owned by their ustreams, so duplicates of
+** both are polled while the data bypasses them. */
+static bool relay_splice_start(struct relay *r)
+{
+	struct client *cl = r->cl;
+
+	r->splice_rd.fd = dup(r->sfd.fd.fd);
+	if (r->splice_rd.fd < 0)
+		return false;
+
+	r->splice_wr.fd = dup(cl->sfd.fd.fd);
+	if (r->splice_wr.fd < 0) {
+		close(r->splice_rd.fd);
+		return false;
+	}
+
+	fd_cloexec(r->splice_rd.fd);
+	fd_cloexec(r->splice_wr.fd);
+	r->splice_rd.cb = relay_splice_rd_cb;
+	r->splice_wr.cb = relay_splice_wr_cb;
+	r->splicing = true;
+
+	ustream_set_read_blocked(&r->sfd.stream, true);
+
+	return true;
+}
+
+static void relay_splice_fallback(struct relay *r)
+{
+	relay_splice_stop(r);
+	r->splice = false;
+	ustream_set_read_blocked(&r->sfd.stream, false);
+}
+
+/* Moves script output from the pipe to the client socket in the kernel. */
+static void relay_splice(struct relay *r)
+{
+	struct client *cl = r->cl;
+	struct ustream *s = &r->sfd.stream;
+	ssize_t n;
+	int avail;
+
+	while (1) {
+		/* earlier output is still queued in the client ustream, its
+		 * write callback resumes the relay once it is sent */
+		if (ustream_pending_data(cl->us, true)) {
+			uloop_fd_delete(&r->splice_rd);
+			uloop_fd_delete(&r->splice_wr);
+			return;
+		}
+
+		n = splice(r->splice_rd.fd, NULL, r->splice_wr.fd, NULL, UH_SPLICE_CHUNK,
+			   SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+
+		if (n > 0) {
+			uh_metrics.bytes_out += n;
+			uh_client_touch(cl);
+			continue;
+		}
+
+		if (!n) {
+			relay_splice_stop(r);
+			s->eof = true;
+			uloop_timeout_set(&r->timeout, 1);
+			return;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EINVAL || errno == ENOSYS)
+			return relay_splice_fallback(r);
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			relay_splice_stop(r);
+			cl->us->write_error = true;
+			ustream_state_change(cl->us);
+			return;
+		}
+
+		break;
+	}
+
+	/* find out which side would block */
+	if (ioctl(r->splice_rd.fd, FIONREAD, &avail) || !avail) {
+		uloop_fd_delete(&r->splice_wr);
+		uloop_fd_add(&r->splice_rd, ULOOP_READ);
+	} else {
+		uloop_fd_delete(&r->splice_rd);
+		uloop_fd_add(&r->splice_wr, ULOOP_WRITE);
+	}
+}
+#else
+static inline bool relay_splice_start(struct relay *r)
+{
+	return false;
+}
+
+static inline void relay_splice(struct relay *r)
+{
+}
+#endif
+
 static void relay_read_cb(struct ustream *s, int bytes)
 {
 	struct relay *r = container_of(s, struct relay, sfd.stream);
@@ -133,19 +270,27 @@ static void relay_read_cb(struct ustream *s, int bytes)
 		return;
 	}
 
+	if (r->splicing) {
+		ustream_set_read_blocked(s, true);
+		return relay_splice(r);
+	}
+
 	if (!s->eof && ustream_pending_data(us, true)) {
 		ustream_set_read_blocked(s, true);
 		return;
 	}
 
 	buf = ustream_get_read_buf(s, &len);
-	if (!buf || !len)
-		return;
+	if (buf && len) {
+		if (!r->skip_data)
+			uh_chunk_write(cl, buf, len);
 
-	if (!r->skip_data)
-		uh_chunk_write(cl, buf, len);
+		ustream_consume(s, len);
+	}
 
-	ustream_consume(s, len);
+	/* whatever was buffered along with the headers went out first */
+	if (r->splice && !s->eof && relay_splice_start(r))
+		relay_splice(r);
 }
 
 static void relay_close_if_done(struct uloop_timeout *timeout)
@@ -153,6 +298,10 @@ static void relay_close_if_done(struct uloop_timeout *timeout)
 	struct relay *r = container_of(timeout, struct relay, timeout);
 	struct ustream *s = &r->sfd.stream;
 
+	/* the output still in the pipe is sent before the relay may close */
+	if (r->splicing)
+		return;
+
 	while (ustream_poll(&r->sfd.stream));
 
 	if (!(r->process_done || s->eof) || ustream_pending_data(s, false))
@@ -182,7 +331,9 @@ void uh_relay_kill(struct client *cl, struct relay *r)
 {
 	struct ustream *us = &r->sfd.stream;
 
-	kill(r->proc.pid, SIGKILL);
+	if (r->proc.pid > 0)
+		kill(r->proc.pid, SIGKILL);
+
 	us->eof = true;
 	ustream_state_change(us);
 }
@@ -192,14 +343,17 @@ void uh_relay_open(struct client *cl, struct relay *r, int fd, int pid)
 	struct ustream *us = &r->sfd.stream;
 
 	r->cl = cl;
+	r->start = uh_metrics_now();
 	us->notify_read = relay_read_cb;
 	us->notify_state = relay_state_cb;
 	us->string_data = true;
 	ustream_fd_init(&r->sfd, fd);
 
+	/* without a child of its own, the relay ends on eof */
 	r->proc.pid = pid;
 	r->proc.cb = relay_proc_cb;
-	uloop_process_add(&r->proc);
+	if (pid > 0)
+		uloop_process_add(&r->proc);
 
 	r->timeout.cb = relay_close_if_done;
 }
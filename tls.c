@@ -27,9 +27,87 @@
 #define LIB_EXT "so"
 #endif
 
+/*
+ * Sessions and ticket keys live in the ustream-ssl context. New clients get
+ * the current one. A context that was rotated out is freed once its last
+ * client is gone, since some backends do not reference count it.
+ */
+struct tls_context {
+	struct list_head list;
+	void *ctx;
+	int refcount;
+};
+
 static struct ustream_ssl_ops *ops;
 static void *dlh;
-static void *ctx;
+static struct tls_context *ctx;
+static LIST_HEAD(retired);
+static const char *tls_key, *tls_crt;
+
+static struct tls_context *uh_tls_context_new(void)
+{
+	struct tls_context *tc;
+	void *c;
+
+	c = ops->context_new(true);
+	if (!c) {
+		fprintf(stderr, "Failed to initialize ustream-ssl\n");
+		return NULL;
+	}
+
+	if (ops->context_set_crt_file(c, tls_crt) ||
+	    ops->context_set_key_file(c, tls_key)) {
+		fprintf(stderr, "Failed to load certificate/key files\n");
+		ops->context_free(c);
+		return NULL;
+	}
+
+	tc = calloc(1, sizeof(*tc));
+	if (!tc) {
+		ops->context_free(c);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&tc->list);
+	tc->ctx = c;
+
+	return tc;
+}
+
+static void uh_tls_context_put(struct tls_context *tc)
+{
+	if (tc == ctx || tc->refcount)
+		return;
+
+	list_del(&tc->list);
+	ops->context_free(tc->ctx);
+	free(tc);
+}
+
+static void uh_tls_context_replace(struct tls_context *tc)
+{
+	struct tls_context *old = ctx;
+
+	ctx = tc;
+	list_add(&old->list, &retired);
+	uh_tls_context_put(old);
+}
+
+/* a fresh context also means fresh ticket keys, the old ones are dropped */
+static void uh_tls_rotate_cb(struct uloop_timeout *t)
+{
+	struct tls_context *tc;
+
+	uloop_timeout_set(t, conf.tls_rotate * 1000);
+
+	tc = uh_tls_context_new();
+	if (tc)
+		uh_tls_context_replace(tc);
+}
+
+static struct uloop_timeout rotate_timer = {
+	.cb = uh_tls_rotate_cb,
+};
 
 int uh_tls_init(const char *key, const char *crt)
 {
@@ -51,17 +129,30 @@ int uh_tls_init(const char *key, const char *crt)
 		return -ENOENT;
 	}
 
-	ctx = ops->context_new(true);
-	if (!ctx) {
-		fprintf(stderr, "Failed to initialize ustream-ssl\n");
+	tls_key = key;
+	tls_crt = crt;
+
+	ctx = uh_tls_context_new();
+	if (!ctx)
 		return -EINVAL;
-	}
 
-	if (ops->context_set_crt_file(ctx, crt) ||
-	    ops->context_set_key_file(ctx, key)) {
-		fprintf(stderr, "Failed to load certificate/key files\n");
+	return 0;
+}
+
+/* Worker processes must not share the RNG and session state of the
+** context inherited from the supervisor, so each one builds its own. */
+int uh_tls_reinit(void)
+{
+	struct tls_context *tc;
+
+	if (!ctx)
+		return 0;
+
+	tc = uh_tls_context_new();
+	if (!tc)
 		return -EINVAL;
-	}
+
+	uh_tls_context_replace(tc);
 
 	return 0;
 }
@@ -70,6 +161,7 @@ static void tls_ustream_read_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, ssl.stream);
 
+	uh_metrics.bytes_in += bytes;
 	uh_client_read_cb(cl);
 }
 
@@ -90,8 +182,14 @@ static void tls_notify_state(struct ustream *s)
 
 void uh_tls_client_attach(struct client *cl)
 {
+	if (conf.tls_rotate > 0 && !rotate_timer.pending)
+		uloop_timeout_set(&rotate_timer, conf.tls_rotate * 1000);
+
+	cl->tls_ctx = ctx;
+	ctx->refcount++;
+
 	cl->us = &cl->ssl.stream;
-	ops->init(&cl->ssl, &cl->sfd.stream, ctx, true);
+	ops->init(&cl->ssl, &cl->sfd.stream, ctx->ctx, true);
 	cl->us->notify_read = tls_ustream_read_cb;
 	cl->us->notify_write = tls_ustream_write_cb;
 	cl->us->notify_state = tls_notify_state;
@@ -99,5 +197,10 @@ void uh_tls_client_attach(struct client *cl)
 
 void uh_tls_client_detach(struct client *cl)
 {
+	struct tls_context *tc = cl->tls_ctx;
+
 	ustream_free(&cl->ssl.stream);
+
+	tc->refcount--;
+	uh_tls_context_put(tc);
 }
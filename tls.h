@@ -23,6 +23,7 @@
 #ifdef HAVE_TLS
 
 int uh_tls_init(const char *key, const char *crt);
+int uh_tls_reinit(void);
 void uh_tls_client_attach(struct client *cl);
 void uh_tls_client_detach(struct client *cl);
 
@@ -33,6 +34,11 @@ static inline int uh_tls_init(const char *key, const char *crt)
 	return -1;
 }
 
+static inline int uh_tls_reinit(void)
+{
+	return 0;
+}
+
 static inline void uh_tls_client_attach(struct client *cl)
 {
 }
@@ -22,6 +22,7 @@
 #include <libubox/avl.h>
 #include <libubox/avl-cmp.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <poll.h>
 
 #include "uhttpd.h"
@@ -36,6 +37,14 @@ static struct blob_buf buf;
 
 #define UH_UBUS_MAX_POST_SIZE	4096
 #define UH_UBUS_DEFAULT_SID	"00000000000000000000000000000000"
+#define UH_UBUS_ACL_TTL		10
+#define UH_UBUS_ACL_MAX		128
+#define UH_UBUS_OBJ_MAX		256
+#define UH_UBUS_MAX_CONCURRENT	8
+#define UH_UBUS_JSON_CHUNK	2048
+#define UH_UBUS_STREAM_PATH	"/subscribe/"
+#define UH_UBUS_STREAM_BACKLOG	(64 * 1024)
+#define UH_UBUS_TOPIC_LINGER	5000
 
 enum {
 	RPC_JSONRPC,
@@ -61,6 +70,61 @@ static const struct blobmsg_policy ses_policy[__SES_MAX] = {
 	[SES_ACCESS] = { .name = "access", .type = BLOBMSG_TYPE_BOOL },
 };
 
+enum {
+	SES_NOTIFY_SID,
+	__SES_NOTIFY_MAX,
+};
+
+static const struct blobmsg_policy ses_notify_policy[__SES_NOTIFY_MAX] = {
+	[SES_NOTIFY_SID] = { .name = "ubus_rpc_session", .type = BLOBMSG_TYPE_STRING },
+};
+
+/* cached session.access result for "sid object function" */
+struct acl_cache_entry {
+	struct avl_node avl;
+	time_t expires;
+	bool allow;
+	char key[];
+};
+
+enum {
+	OBJ_EVENT_ID,
+	OBJ_EVENT_PATH,
+	__OBJ_EVENT_MAX,
+};
+
+static const struct blobmsg_policy obj_event_policy[__OBJ_EVENT_MAX] = {
+	[OBJ_EVENT_ID] = { .name = "id", .type = BLOBMSG_TYPE_INT32 },
+	[OBJ_EVENT_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
+};
+
+/* object path to id, kept current by ubusd's object events */
+struct obj_cache_entry {
+	struct avl_node avl;
+	uint32_t id;
+	char path[];
+};
+
+static AVL_TREE(obj_cache, avl_strcmp, false, NULL);
+static struct ubus_event_handler obj_event;
+static bool obj_cache_valid;
+
+static AVL_TREE(acl_cache, avl_strcmp, false, NULL);
+static struct ubus_subscriber session_sub;
+static uint32_t session_id;
+
+/* one subscriber per object, shared by all event streams on it */
+struct ubus_stream_topic {
+	struct avl_node avl;
+	struct ubus_subscriber sub;
+	struct uloop_timeout free_timer;
+	struct list_head clients;
+	bool removed;
+	char path[];
+};
+
+static AVL_TREE(stream_topics, avl_strcmp, false, NULL);
+
 struct rpc_data {
 	struct blob_attr *id;
 	const char *sid;
@@ -104,54 +168,219 @@ static const struct {
 	[ERROR_TIMEOUT] = { -32003, "ubus request timed out" },
 };
 
-enum cors_hdr {
-	HDR_ORIGIN,
-	HDR_ACCESS_CONTROL_REQUEST_METHOD,
-	HDR_ACCESS_CONTROL_REQUEST_HEADERS,
-	__HDR_MAX
+static void uh_ubus_pump_cb(struct uloop_timeout *timeout);
+static void uh_ubus_stream_revoke(const char *sid);
+static void uh_ubus_stream_leave(struct dispatch_ubus *du);
+static void uh_ubus_stream_start_cb(struct uloop_timeout *timeout);
+static void uh_ubus_access_done(struct ubus_call *c, bool allow);
+
+/* state of one JSON-RPC call, a batch runs several of them at once */
+struct ubus_call {
+	struct client *cl;
+	struct json_object *obj;
+
+	struct ubus_request req;
+	struct uloop_timeout timeout;
+	bool req_pending;
+	uint64_t start;
+
+	uint32_t id;
+	const char *sid;
+	const char *object;
+	const char *func;
+	struct blob_attr *args;
+	struct blob_attr *params;
+	bool allow;
+
+	struct blob_buf buf;
+	struct blob_attr *result;
+	bool done;
+};
+
+/* blobmsg to JSON encoder writing bounded chunks straight to the client */
+struct json_writer {
+	struct client *cl;
+	int len;
+	char buf[UH_UBUS_JSON_CHUNK];
 };
 
-static void __uh_ubus_next_batched_request(struct uloop_timeout *timeout);
+static void uh_ubus_json_element(struct json_writer *w, struct blob_attr *attr);
 
-static void uh_ubus_next_batched_request(struct client *cl)
+static void uh_ubus_json_flush(struct json_writer *w)
 {
-	struct dispatch_ubus *du = &cl->dispatch.ubus;
+	if (w->len)
+		ops->chunk_write(w->cl, w->buf, w->len);
 
-	du->timeout.cb = __uh_ubus_next_batched_request;
-	uloop_timeout_set(&du->timeout, 1);
+	w->len = 0;
 }
 
-static void uh_ubus_add_cors_headers(struct client *cl)
+static void uh_ubus_json_put(struct json_writer *w, const char *data, int len)
 {
-	struct blob_attr *tb[__HDR_MAX];
-	static const struct blobmsg_policy hdr_policy[__HDR_MAX] = {
-		[HDR_ORIGIN] = { "origin", BLOBMSG_TYPE_STRING },
-		[HDR_ACCESS_CONTROL_REQUEST_METHOD] = { "access-control-request-method", BLOBMSG_TYPE_STRING },
-		[HDR_ACCESS_CONTROL_REQUEST_HEADERS] = { "access-control-request-headers", BLOBMSG_TYPE_STRING },
-	};
+	int cur;
 
-	blobmsg_parse(hdr_policy, __HDR_MAX, tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
+	while (len > 0) {
+		cur = min(len, (int) sizeof(w->buf) - w->len);
+		memcpy(w->buf + w->len, data, cur);
+		w->len += cur;
+		data += cur;
+		len -= cur;
 
-	if (!tb[HDR_ORIGIN])
-		return;
+		if (w->len == sizeof(w->buf))
+			uh_ubus_json_flush(w);
+	}
+}
 
-	if (tb[HDR_ACCESS_CONTROL_REQUEST_METHOD])
-	{
-		char *hdr = (char *) blobmsg_data(tb[HDR_ACCESS_CONTROL_REQUEST_METHOD]);
+static void uh_ubus_json_puts(struct json_writer *w, const char *str)
+{
+	uh_ubus_json_put(w, str, strlen(str));
+}
 
-		if (strcmp(hdr, "POST") && strcmp(hdr, "OPTIONS"))
-			return;
+static void uh_ubus_json_string(struct json_writer *w, const char *str)
+{
+	const unsigned char *p, *last;
+	char ubuf[8];
+	const char *esc;
+
+	uh_ubus_json_put(w, "\"", 1);
+
+	for (p = last = (const unsigned char *) str; *p; p++) {
+		switch (*p) {
+		case '\b':
+			esc = "\\b";
+			break;
+		case '\n':
+			esc = "\\n";
+			break;
+		case '\r':
+			esc = "\\r";
+			break;
+		case '\t':
+			esc = "\\t";
+			break;
+		case '"':
+			esc = "\\\"";
+			break;
+		case '\\':
+			esc = "\\\\";
+			break;
+		default:
+			if (*p >= ' ')
+				continue;
+
+			snprintf(ubuf, sizeof(ubuf), "\\u%04x", *p);
+			esc = ubuf;
+			break;
+		}
+
+		uh_ubus_json_put(w, (const char *) last, p - last);
+		uh_ubus_json_puts(w, esc);
+		last = p + 1;
+	}
+
+	uh_ubus_json_put(w, (const char *) last, p - last);
+	uh_ubus_json_put(w, "\"", 1);
+}
+
+static void uh_ubus_json_list(struct json_writer *w, struct blob_attr *data,
+			      int len, bool array)
+{
+	struct blob_attr *cur;
+	bool first = true;
+
+	uh_ubus_json_put(w, array ? "[" : "{", 1);
+
+	__blob_for_each_attr(cur, data, len) {
+		if (!first)
+			uh_ubus_json_put(w, ",", 1);
+
+		if (!array) {
+			uh_ubus_json_string(w, blobmsg_name(cur));
+			uh_ubus_json_put(w, ":", 1);
+		}
+
+		uh_ubus_json_element(w, cur);
+		first = false;
+	}
+
+	uh_ubus_json_put(w, array ? "]" : "}", 1);
+}
+
+static void uh_ubus_json_element(struct json_writer *w, struct blob_attr *attr)
+{
+	char num[32];
+
+	switch (blob_id(attr)) {
+	case BLOBMSG_TYPE_BOOL:
+		uh_ubus_json_puts(w, blobmsg_get_u8(attr) ? "true" : "false");
+		return;
+	case BLOBMSG_TYPE_INT16:
+		snprintf(num, sizeof(num), "%d", (int16_t) blobmsg_get_u16(attr));
+		break;
+	case BLOBMSG_TYPE_INT32:
+		snprintf(num, sizeof(num), "%d", (int32_t) blobmsg_get_u32(attr));
+		break;
+	case BLOBMSG_TYPE_INT64:
+		snprintf(num, sizeof(num), "%lld", (long long) (int64_t) blobmsg_get_u64(attr));
+		break;
+	case BLOBMSG_TYPE_DOUBLE:
+		snprintf(num, sizeof(num), "%lf", blobmsg_get_double(attr));
+		break;
+	case BLOBMSG_TYPE_STRING:
+		uh_ubus_json_string(w, blobmsg_get_string(attr));
+		return;
+	case BLOBMSG_TYPE_ARRAY:
+	case BLOBMSG_TYPE_TABLE:
+		uh_ubus_json_list(w, blobmsg_data(attr), blobmsg_data_len(attr),
+				  blob_id(attr) == BLOBMSG_TYPE_ARRAY);
+		return;
+	default:
+		strcpy(num, "null");
+		break;
 	}
 
-	ustream_printf(cl->us, "Access-Control-Allow-Origin: %s\r\n",
-	               blobmsg_data(tb[HDR_ORIGIN]));
+	uh_ubus_json_puts(w, num);
+}
+
+/* write prefix and the blobmsg table in msg as one JSON object */
+static void uh_ubus_send_json(struct client *cl, const char *prefix, struct blob_attr *msg)
+{
+	static struct json_writer w;
+
+	w.cl = cl;
+	w.len = 0;
+	uh_ubus_json_puts(&w, prefix);
+	uh_ubus_json_list(&w, blob_data(msg), blob_len(msg), false);
+	uh_ubus_json_flush(&w);
+}
+
+static void uh_ubus_schedule(struct client *cl)
+{
+	struct dispatch_ubus *du = &cl->dispatch.ubus;
+
+	du->timeout.cb = uh_ubus_pump_cb;
+	uloop_timeout_set(&du->timeout, 0);
+}
+
+static void uh_ubus_add_cors_headers(struct client *cl)
+{
+	char *origin = uh_header(cl, UH_HDR_ORIGIN);
+	char *method = uh_header(cl, UH_HDR_ACCESS_CONTROL_REQUEST_METHOD);
+	char *headers = uh_header(cl, UH_HDR_ACCESS_CONTROL_REQUEST_HEADERS);
+
+	if (!origin)
+		return;
+
+	if (method && strcmp(method, "GET") && strcmp(method, "POST") &&
+	    strcmp(method, "OPTIONS"))
+		return;
 
-	if (tb[HDR_ACCESS_CONTROL_REQUEST_HEADERS])
-		ustream_printf(cl->us, "Access-Control-Allow-Headers: %s\r\n",
-		               blobmsg_data(tb[HDR_ACCESS_CONTROL_REQUEST_HEADERS]));
+	ops->response_printf(cl, "Access-Control-Allow-Origin: %s\r\n", origin);
 
-	ustream_printf(cl->us, "Access-Control-Allow-Methods: POST, OPTIONS\r\n");
-	ustream_printf(cl->us, "Access-Control-Allow-Credentials: true\r\n");
+	if (headers)
+		ops->response_printf(cl, "Access-Control-Allow-Headers: %s\r\n", headers);
+
+	ops->response_printf(cl, "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n");
+	ops->response_printf(cl, "Access-Control-Allow-Credentials: true\r\n");
 }
 
 static void uh_ubus_send_header(struct client *cl)
@@ -161,38 +390,35 @@ static void uh_ubus_send_header(struct client *cl)
 	if (conf.ubus_cors)
 		uh_ubus_add_cors_headers(cl);
 
-	ustream_printf(cl->us, "Content-Type: application/json\r\n");
+	ops->response_printf(cl, "Content-Type: application/json\r\n");
 
 	if (cl->request.method == UH_HTTP_MSG_OPTIONS)
-		ustream_printf(cl->us, "Content-Length: 0\r\n");
+		ops->response_printf(cl, "Content-Length: 0\r\n");
 
-	ustream_printf(cl->us, "\r\n");
+	ops->response_printf(cl, "\r\n");
+	ops->response_flush(cl);
 }
 
-static void uh_ubus_send_response(struct client *cl)
+/* results are kept until all calls before them have been sent */
+static void uh_ubus_finish_call(struct ubus_call *c)
 {
-	struct dispatch_ubus *du = &cl->dispatch.ubus;
-	const char *sep = "";
-	char *str;
+	struct dispatch_ubus *du = &c->cl->dispatch.ubus;
 
-	if (du->array && du->array_idx > 1)
-		sep = ",";
+	c->result = blob_memdup(buf.head);
+	c->done = true;
 
-	str = blobmsg_format_json(buf.head, true);
-	ops->chunk_printf(cl, "%s%s", sep, str);
-	free(str);
+	blob_buf_free(&c->buf);
 
-	du->jsobj_cur = NULL;
-	if (du->array)
-		uh_ubus_next_batched_request(cl);
-	else
-		return ops->request_done(cl);
+	free(c->params);
+	c->params = NULL;
+
+	du->n_active--;
+	uh_ubus_schedule(c->cl);
 }
 
-static void uh_ubus_init_response(struct client *cl)
+static void uh_ubus_init_response(struct json_object *obj)
 {
-	struct dispatch_ubus *du = &cl->dispatch.ubus;
-	struct json_object *obj = du->jsobj_cur, *obj2 = NULL;
+	struct json_object *obj2 = NULL;
 
 	blob_buf_init(&buf, 0);
 	blobmsg_add_string(&buf, "jsonrpc", "2.0");
@@ -206,69 +432,97 @@ static void uh_ubus_init_response(struct client *cl)
 		blobmsg_add_field(&buf, BLOBMSG_TYPE_UNSPEC, "id", NULL, 0);
 }
 
-static void uh_ubus_json_error(struct client *cl, enum rpc_error type)
+static void uh_ubus_init_error(struct json_object *obj, enum rpc_error type)
 {
 	void *c;
 
-	uh_ubus_init_response(cl);
+	uh_ubus_init_response(obj);
 	c = blobmsg_open_table(&buf, "error");
 	blobmsg_add_u32(&buf, "code", json_errors[type].code);
 	blobmsg_add_string(&buf, "message", json_errors[type].msg);
 	blobmsg_close_table(&buf, c);
-	uh_ubus_send_response(cl);
+}
+
+static void uh_ubus_json_error(struct ubus_call *c, enum rpc_error type)
+{
+	uh_ubus_init_error(c->obj, type);
+	uh_ubus_finish_call(c);
 }
 
 static void
 uh_ubus_request_data_cb(struct ubus_request *req, int type, struct blob_attr *msg)
 {
-	struct dispatch_ubus *du = container_of(req, struct dispatch_ubus, req);
+	struct ubus_call *c = container_of(req, struct ubus_call, req);
 
-	blobmsg_add_field(&du->buf, BLOBMSG_TYPE_TABLE, "", blob_data(msg), blob_len(msg));
+	blobmsg_add_field(&c->buf, BLOBMSG_TYPE_TABLE, "", blob_data(msg), blob_len(msg));
 }
 
 static void
 uh_ubus_request_cb(struct ubus_request *req, int ret)
 {
-	struct dispatch_ubus *du = container_of(req, struct dispatch_ubus, req);
-	struct client *cl = container_of(du, struct client, dispatch.ubus);
+	struct ubus_call *c = container_of(req, struct ubus_call, req);
 	struct blob_attr *cur;
 	void *r;
 	int rem;
 
-	uloop_timeout_cancel(&du->timeout);
-	uh_ubus_init_response(cl);
+	uloop_timeout_cancel(&c->timeout);
+	c->req_pending = false;
+	ops->metrics_timing(UH_TIMING_UBUS_CALL, c->start);
+
+	uh_ubus_init_response(c->obj);
 	r = blobmsg_open_array(&buf, "result");
 	blobmsg_add_u32(&buf, "", ret);
-	blob_for_each_attr(cur, du->buf.head, rem)
+	blob_for_each_attr(cur, c->buf.head, rem)
 		blobmsg_add_blob(&buf, cur);
 	blobmsg_close_array(&buf, r);
-	uh_ubus_send_response(cl);
+	uh_ubus_finish_call(c);
 }
 
 static void
 uh_ubus_timeout_cb(struct uloop_timeout *timeout)
 {
-	struct dispatch_ubus *du = container_of(timeout, struct dispatch_ubus, timeout);
-	struct client *cl = container_of(du, struct client, dispatch.ubus);
+	struct ubus_call *c = container_of(timeout, struct ubus_call, timeout);
+
+	ubus_abort_request(ctx, &c->req);
+	c->req_pending = false;
+	ops->metrics_timing(UH_TIMING_UBUS_CALL, c->start);
 
-	ubus_abort_request(ctx, &du->req);
-	uh_ubus_json_error(cl, ERROR_TIMEOUT);
+	if (c->cl->dispatch.ubus.stream)
+		uh_ubus_access_done(c, false);
+	else
+		uh_ubus_json_error(c, ERROR_TIMEOUT);
 }
 
-static void uh_ubus_close_fds(struct client *cl)
+static int uh_ubus_child_fds(struct client *cl, int *fds)
 {
 	if (ctx->sock.fd < 0)
-		return;
+		return 0;
 
-	close(ctx->sock.fd);
-	ctx->sock.fd = -1;
+	fds[0] = ctx->sock.fd;
+	return 1;
 }
 
 static void uh_ubus_request_free(struct client *cl)
 {
 	struct dispatch_ubus *du = &cl->dispatch.ubus;
+	struct ubus_call *c;
+	int i;
+
+	uh_ubus_stream_leave(du);
+
+	for (i = 0; i < du->n_calls; i++) {
+		c = &du->calls[i];
+
+		uloop_timeout_cancel(&c->timeout);
+		if (c->req_pending)
+			ubus_abort_request(ctx, &c->req);
+
+		blob_buf_free(&c->buf);
+		free(c->params);
+		free(c->result);
+	}
 
-	blob_buf_free(&du->buf);
+	free(du->calls);
 	uloop_timeout_cancel(&du->timeout);
 
 	if (du->jsobj)
@@ -276,49 +530,47 @@ static void uh_ubus_request_free(struct client *cl)
 
 	if (du->jstok)
 		json_tokener_free(du->jstok);
-
-	if (du->req_pending)
-		ubus_abort_request(ctx, &du->req);
 }
 
 static void uh_ubus_single_error(struct client *cl, enum rpc_error type)
 {
 	uh_ubus_send_header(cl);
-	uh_ubus_json_error(cl, type);
+	uh_ubus_init_error(NULL, type);
+	uh_ubus_send_json(cl, "", buf.head);
+
 	ops->request_done(cl);
 }
 
-static void uh_ubus_send_request(struct client *cl, json_object *obj, const char *sid, struct blob_attr *args)
+static void uh_ubus_send_request(struct ubus_call *c)
 {
-	struct dispatch *d = &cl->dispatch;
-	struct dispatch_ubus *du = &d->ubus;
 	struct blob_attr *cur;
 	static struct blob_buf req;
 	int ret, rem;
 
 	blob_buf_init(&req, 0);
-	blobmsg_for_each_attr(cur, args, rem) {
+	blobmsg_for_each_attr(cur, c->args, rem) {
 		if (!strcmp(blobmsg_name(cur), "ubus_rpc_session"))
-			return uh_ubus_json_error(cl, ERROR_PARAMS);
+			return uh_ubus_json_error(c, ERROR_PARAMS);
 		blobmsg_add_blob(&req, cur);
 	}
 
-	blobmsg_add_string(&req, "ubus_rpc_session", sid);
+	blobmsg_add_string(&req, "ubus_rpc_session", c->sid);
 
-	blob_buf_init(&du->buf, 0);
-	memset(&du->req, 0, sizeof(du->req));
-	ret = ubus_invoke_async(ctx, du->obj, du->func, req.head, &du->req);
+	blob_buf_init(&c->buf, 0);
+	memset(&c->req, 0, sizeof(c->req));
+	ret = ubus_invoke_async(ctx, c->id, c->func, req.head, &c->req);
 	if (ret)
-		return uh_ubus_json_error(cl, ERROR_INTERNAL);
+		return uh_ubus_json_error(c, ERROR_INTERNAL);
 
-	du->req.data_cb = uh_ubus_request_data_cb;
-	du->req.complete_cb = uh_ubus_request_cb;
-	ubus_complete_request_async(ctx, &du->req);
+	c->req.data_cb = uh_ubus_request_data_cb;
+	c->req.complete_cb = uh_ubus_request_cb;
+	c->start = ops->metrics_now();
+	ubus_complete_request_async(ctx, &c->req);
 
-	du->timeout.cb = uh_ubus_timeout_cb;
-	uloop_timeout_set(&du->timeout, conf.script_timeout * 1000);
+	c->timeout.cb = uh_ubus_timeout_cb;
+	uloop_timeout_set(&c->timeout, conf.script_timeout * 1000);
 
-	du->req_pending = true;
+	c->req_pending = true;
 }
 
 static void uh_ubus_list_cb(struct ubus_context *ctx, struct ubus_object_data *obj, void *priv)
@@ -370,16 +622,16 @@ static void uh_ubus_list_cb(struct ubus_context *ctx, struct ubus_object_data *o
 	blobmsg_close_table(data->buf, o);
 }
 
-static void uh_ubus_send_list(struct client *cl, json_object *obj, struct blob_attr *params)
+static void uh_ubus_send_list(struct ubus_call *c, struct blob_attr *params)
 {
 	struct blob_attr *cur, *dup;
-	struct list_data data = { .buf = &cl->dispatch.ubus.buf, .verbose = false };
+	struct list_data data = { .buf = &c->buf, .verbose = false };
 	void *r;
 	int rem;
 
 	blob_buf_init(data.buf, 0);
 
-	uh_client_ref(cl);
+	uh_client_ref(c->cl);
 
 	if (!params || blob_id(params) != BLOBMSG_TYPE_ARRAY) {
 		r = blobmsg_open_array(data.buf, "result");
@@ -400,11 +652,11 @@ static void uh_ubus_send_list(struct client *cl, json_object *obj, struct blob_a
 		blobmsg_close_table(data.buf, r);
 	}
 
-	uh_client_unref(cl);
+	uh_client_unref(c->cl);
 
-	uh_ubus_init_response(cl);
+	uh_ubus_init_response(c->obj);
 	blobmsg_add_blob(&buf, blob_data(data.buf->head));
-	uh_ubus_send_response(cl);
+	uh_ubus_finish_call(c);
 }
 
 static bool parse_json_rpc(struct rpc_data *d, struct blob_attr *data)
@@ -460,25 +712,229 @@ static bool parse_json_rpc(struct rpc_data *d, struct blob_attr *data)
 	return true;
 }
 
-static void uh_ubus_init_batch(struct client *cl)
+static void uh_ubus_obj_flush(void)
 {
-	struct dispatch_ubus *du = &cl->dispatch.ubus;
+	struct obj_cache_entry *e, *tmp;
 
-	du->array = true;
-	uh_ubus_send_header(cl);
-	ops->chunk_printf(cl, "[");
+	avl_remove_all_elements(&obj_cache, e, avl, tmp)
+		free(e);
 }
 
-static void uh_ubus_complete_batch(struct client *cl)
+static void uh_ubus_obj_event(struct ubus_context *ctx, struct ubus_event_handler *ev,
+			      const char *type, struct blob_attr *msg)
 {
-	ops->chunk_printf(cl, "]");
-	ops->request_done(cl);
+	struct blob_attr *tb[__OBJ_EVENT_MAX];
+	struct obj_cache_entry *e;
+
+	blobmsg_parse(obj_event_policy, __OBJ_EVENT_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (!tb[OBJ_EVENT_PATH])
+		return uh_ubus_obj_flush();
+
+	/* an added object may replace an old id of the same path as well */
+	e = avl_find_element(&obj_cache, blobmsg_get_string(tb[OBJ_EVENT_PATH]), e, avl);
+	if (!e)
+		return;
+
+	avl_delete(&obj_cache, &e->avl);
+	free(e);
+}
+
+static int uh_ubus_lookup_id(const char *path, uint32_t *id)
+{
+	struct obj_cache_entry *e;
+	int ret;
+
+	if (obj_cache_valid) {
+		e = avl_find_element(&obj_cache, path, e, avl);
+		if (e) {
+			*id = e->id;
+			return 0;
+		}
+	}
+
+	ret = ubus_lookup_id(ctx, path, id);
+	if (ret || !obj_cache_valid)
+		return ret;
+
+	if (obj_cache.count >= UH_UBUS_OBJ_MAX)
+		uh_ubus_obj_flush();
+
+	e = calloc(1, sizeof(*e) + strlen(path) + 1);
+	if (!e)
+		return 0;
+
+	strcpy(e->path, path);
+	e->avl.key = e->path;
+	e->id = *id;
+	avl_insert(&obj_cache, &e->avl);
+
+	return 0;
+}
+
+static time_t uh_ubus_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/* fields are length prefixed, all of them come from the client */
+static bool uh_ubus_acl_key(char *key, int len, const char *sid,
+			    const char *obj, const char *fun)
+{
+	int n;
+
+	n = snprintf(key, len, "%zu:%s%zu:%s%zu:%s", strlen(sid), sid,
+		     strlen(obj), obj, strlen(fun), fun);
+
+	return n >= 0 && n < len;
+}
+
+static void uh_ubus_acl_flush(const char *sid)
+{
+	struct acl_cache_entry *e, *tmp;
+	char prefix[256];
+	int len = 0;
+
+	if (sid)
+		len = snprintf(prefix, sizeof(prefix), "%zu:%s", strlen(sid), sid);
+
+	/* keys are as long as the prefix at most, so this sid has none */
+	if (len >= sizeof(prefix))
+		return;
+
+	avl_for_each_element_safe(&acl_cache, e, avl, tmp) {
+		if (sid && strncmp(e->key, prefix, len))
+			continue;
+
+		avl_delete(&acl_cache, &e->avl);
+		free(e);
+	}
+}
+
+/* 1 allowed, 0 denied, -1 unknown */
+static int uh_ubus_acl_get(const char *sid, const char *obj, const char *fun)
+{
+	struct acl_cache_entry *e;
+	char key[256];
+
+	/* without session events there is no way to notice a revoked session */
+	if (!session_id)
+		return -1;
+
+	if (!uh_ubus_acl_key(key, sizeof(key), sid, obj, fun))
+		return -1;
+
+	e = avl_find_element(&acl_cache, key, e, avl);
+	if (!e)
+		return -1;
+
+	if (uh_ubus_now() >= e->expires) {
+		avl_delete(&acl_cache, &e->avl);
+		free(e);
+		return -1;
+	}
+
+	return e->allow;
+}
+
+static void uh_ubus_acl_add(const char *sid, const char *obj, const char *fun, bool allow)
+{
+	struct acl_cache_entry *e;
+	char key[256];
+
+	if (!session_id)
+		return;
+
+	/* an entry for a truncated key could answer for another object */
+	if (!uh_ubus_acl_key(key, sizeof(key), sid, obj, fun))
+		return;
+
+	e = avl_find_element(&acl_cache, key, e, avl);
+	if (!e) {
+		if (acl_cache.count >= UH_UBUS_ACL_MAX)
+			uh_ubus_acl_flush(NULL);
+
+		e = calloc(1, sizeof(*e) + strlen(key) + 1);
+		if (!e)
+			return;
+
+		strcpy(e->key, key);
+		e->avl.key = e->key;
+		avl_insert(&acl_cache, &e->avl);
+	}
+
+	e->expires = uh_ubus_now() + UH_UBUS_ACL_TTL;
+	e->allow = allow;
+}
+
+static int uh_ubus_session_notify(struct ubus_context *ctx, struct ubus_object *obj,
+				  struct ubus_request_data *req, const char *method,
+				  struct blob_attr *msg)
+{
+	struct blob_attr *tb[__SES_NOTIFY_MAX];
+
+	blobmsg_parse(ses_notify_policy, __SES_NOTIFY_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (tb[SES_NOTIFY_SID]) {
+		uh_ubus_acl_flush(blobmsg_get_string(tb[SES_NOTIFY_SID]));
+		uh_ubus_stream_revoke(blobmsg_get_string(tb[SES_NOTIFY_SID]));
+	} else {
+		uh_ubus_acl_flush(NULL);
+		uh_ubus_stream_revoke(NULL);
+	}
+
+	return 0;
+}
+
+static void uh_ubus_session_remove(struct ubus_context *ctx, struct ubus_subscriber *sub,
+				   uint32_t id)
+{
+	session_id = 0;
+	uh_ubus_acl_flush(NULL);
+	uh_ubus_stream_revoke(NULL);
+}
+
+static bool uh_ubus_session_lookup(uint32_t *id)
+{
+	if (session_id) {
+		*id = session_id;
+		return true;
+	}
+
+	if (uh_ubus_lookup_id("session", id))
+		return false;
+
+	if (!ubus_subscribe(ctx, &session_sub, *id))
+		session_id = *id;
+
+	return true;
+}
+
+static void uh_ubus_access_done(struct ubus_call *c, bool allow)
+{
+	struct dispatch_ubus *du = &c->cl->dispatch.ubus;
+
+	if (du->stream) {
+		c->allow = allow;
+		du->timeout.cb = uh_ubus_stream_start_cb;
+		uloop_timeout_set(&du->timeout, 0);
+		return;
+	}
+
+	if (allow)
+		uh_ubus_send_request(c);
+	else
+		uh_ubus_json_error(c, ERROR_ACCESS);
 }
 
 static void uh_ubus_allowed_cb(struct ubus_request *req, int type, struct blob_attr *msg)
 {
+	struct ubus_call *c = container_of(req, struct ubus_call, req);
 	struct blob_attr *tb[__SES_MAX];
-	bool *allow = (bool *)req->priv;
 
 	if (!msg)
 		return;
@@ -486,40 +942,360 @@ static void uh_ubus_allowed_cb(struct ubus_request *req, int type, struct blob_a
 	blobmsg_parse(ses_policy, __SES_MAX, tb, blob_data(msg), blob_len(msg));
 
 	if (tb[SES_ACCESS])
-		*allow = blobmsg_get_bool(tb[SES_ACCESS]);
+		c->allow = blobmsg_get_bool(tb[SES_ACCESS]);
 }
 
-static bool uh_ubus_allowed(const char *sid, const char *obj, const char *fun)
+static void uh_ubus_allowed_complete_cb(struct ubus_request *req, int ret)
+{
+	struct ubus_call *c = container_of(req, struct ubus_call, req);
+
+	uloop_timeout_cancel(&c->timeout);
+	c->req_pending = false;
+	ops->metrics_timing(UH_TIMING_UBUS_CALL, c->start);
+
+	if (!ret)
+		uh_ubus_acl_add(c->sid, c->object, c->func, c->allow);
+
+	uh_ubus_access_done(c, c->allow);
+}
+
+static void uh_ubus_check_access(struct ubus_call *c)
 {
-	uint32_t id;
-	bool allow = false;
 	static struct blob_buf req;
+	uint32_t id;
+	int allow;
 
-	if (ubus_lookup_id(ctx, "session", &id))
-		return false;
+	if (!uh_ubus_session_lookup(&id))
+		return uh_ubus_access_done(c, false);
+
+	allow = uh_ubus_acl_get(c->sid, c->object, c->func);
+	if (allow >= 0)
+		return uh_ubus_access_done(c, allow);
 
 	blob_buf_init(&req, 0);
-	blobmsg_add_string(&req, "ubus_rpc_session", sid);
-	blobmsg_add_string(&req, "object", obj);
-	blobmsg_add_string(&req, "function", fun);
+	blobmsg_add_string(&req, "ubus_rpc_session", c->sid);
+	blobmsg_add_string(&req, "object", c->object);
+	blobmsg_add_string(&req, "function", c->func);
+
+	c->allow = false;
+	memset(&c->req, 0, sizeof(c->req));
+	if (ubus_invoke_async(ctx, id, "access", req.head, &c->req))
+		return uh_ubus_access_done(c, false);
+
+	c->req.data_cb = uh_ubus_allowed_cb;
+	c->req.complete_cb = uh_ubus_allowed_complete_cb;
+	c->start = ops->metrics_now();
+	ubus_complete_request_async(ctx, &c->req);
+
+	c->timeout.cb = uh_ubus_timeout_cb;
+	uloop_timeout_set(&c->timeout, conf.script_timeout * 500);
 
-	ubus_invoke(ctx, id, "access", req.head, uh_ubus_allowed_cb, &allow, conf.script_timeout * 500);
+	c->req_pending = true;
+}
+
+static struct client *uh_ubus_stream_client(struct dispatch_ubus *du)
+{
+	return container_of(du, struct client, dispatch.ubus);
+}
+
+/* a peer that stops reading must not make us buffer without bounds */
+static bool uh_ubus_stream_blocked(struct client *cl)
+{
+	return cl->us->w.data_bytes > UH_UBUS_STREAM_BACKLOG;
+}
+
+static void uh_ubus_stream_dropped(struct client *cl)
+{
+	struct dispatch_ubus *du = &cl->dispatch.ubus;
+
+	if (!du->n_dropped || uh_ubus_stream_blocked(cl))
+		return;
 
-	return allow;
+	ops->chunk_printf(cl, "event: dropped\ndata: {\"count\":%d}\n\n", du->n_dropped);
+	du->n_dropped = 0;
 }
 
-static void uh_ubus_handle_request_object(struct client *cl, struct json_object *obj)
+static void uh_ubus_stream_event(struct client *cl, const char *event, struct blob_attr *msg)
 {
 	struct dispatch_ubus *du = &cl->dispatch.ubus;
+	static struct json_writer w;
+
+	uh_ubus_stream_dropped(cl);
+
+	if (uh_ubus_stream_blocked(cl)) {
+		du->n_dropped++;
+		return;
+	}
+
+	w.cl = cl;
+	w.len = 0;
+	uh_ubus_json_puts(&w, "event: ");
+	uh_ubus_json_puts(&w, event);
+	uh_ubus_json_puts(&w, "\ndata: ");
+	uh_ubus_json_list(&w, msg ? blob_data(msg) : NULL, msg ? blob_len(msg) : 0, false);
+	uh_ubus_json_puts(&w, "\n\n");
+	uh_ubus_json_flush(&w);
+}
+
+static int uh_ubus_topic_notify(struct ubus_context *ctx, struct ubus_object *obj,
+				struct ubus_request_data *req, const char *method,
+				struct blob_attr *msg)
+{
+	struct ubus_subscriber *sub = container_of(obj, struct ubus_subscriber, obj);
+	struct ubus_stream_topic *t = container_of(sub, struct ubus_stream_topic, sub);
+	struct dispatch_ubus *du, *tmp;
+
+	/* a line break in the name would end the event early */
+	if (strpbrk(method, "\r\n"))
+		return 0;
+
+	list_for_each_entry_safe(du, tmp, &t->clients, stream_list)
+		uh_ubus_stream_event(uh_ubus_stream_client(du), method, msg);
+
+	return 0;
+}
+
+static void uh_ubus_topic_remove(struct ubus_context *ctx, struct ubus_subscriber *sub,
+				 uint32_t id)
+{
+	struct ubus_stream_topic *t = container_of(sub, struct ubus_stream_topic, sub);
+	struct dispatch_ubus *du, *tmp;
+
+	/* the object is gone, new streams have to look it up again */
+	if (!t->removed) {
+		avl_delete(&stream_topics, &t->avl);
+		t->removed = true;
+	}
+
+	list_for_each_entry_safe(du, tmp, &t->clients, stream_list)
+		ops->request_done(uh_ubus_stream_client(du));
+}
+
+static void uh_ubus_topic_free_cb(struct uloop_timeout *timeout)
+{
+	struct ubus_stream_topic *t = container_of(timeout, struct ubus_stream_topic, free_timer);
+
+	if (!list_empty(&t->clients))
+		return;
+
+	if (!t->removed)
+		avl_delete(&stream_topics, &t->avl);
+
+	ubus_unregister_subscriber(ctx, &t->sub);
+	free(t);
+}
+
+static struct ubus_stream_topic *uh_ubus_topic_get(const char *path, uint32_t id)
+{
+	struct ubus_stream_topic *t;
+
+	t = avl_find_element(&stream_topics, path, t, avl);
+	if (t) {
+		uloop_timeout_cancel(&t->free_timer);
+		return t;
+	}
+
+	t = calloc(1, sizeof(*t) + strlen(path) + 1);
+	if (!t)
+		return NULL;
+
+	t->sub.cb = uh_ubus_topic_notify;
+	t->sub.remove_cb = uh_ubus_topic_remove;
+	if (ubus_register_subscriber(ctx, &t->sub))
+		goto free;
+
+	if (ubus_subscribe(ctx, &t->sub, id)) {
+		ubus_unregister_subscriber(ctx, &t->sub);
+		goto free;
+	}
+
+	INIT_LIST_HEAD(&t->clients);
+	t->free_timer.cb = uh_ubus_topic_free_cb;
+	strcpy(t->path, path);
+	t->avl.key = t->path;
+	avl_insert(&stream_topics, &t->avl);
+
+	return t;
+
+free:
+	free(t);
+	return NULL;
+}
+
+static void uh_ubus_stream_leave(struct dispatch_ubus *du)
+{
+	struct ubus_stream_topic *t = du->topic;
+
+	if (!t)
+		return;
+
+	list_del(&du->stream_list);
+	du->topic = NULL;
+
+	/* keep the subscription around for clients that reconnect */
+	if (list_empty(&t->clients))
+		uloop_timeout_set(&t->free_timer, UH_UBUS_TOPIC_LINGER);
+}
+
+/* end the streams of a session that was closed or changed */
+static void uh_ubus_stream_revoke(const char *sid)
+{
+	struct ubus_stream_topic *t;
+	struct dispatch_ubus *du, *tmp;
+
+	if (conf.ubus_noauth)
+		return;
+
+	avl_for_each_element(&stream_topics, t, avl) {
+		list_for_each_entry_safe(du, tmp, &t->clients, stream_list) {
+			if (sid && strcmp(du->calls->sid, sid))
+				continue;
+
+			ops->request_done(uh_ubus_stream_client(du));
+		}
+	}
+}
+
+/* comments keep the connection from running into the network timeout */
+static void uh_ubus_stream_ping_cb(struct uloop_timeout *timeout)
+{
+	struct dispatch_ubus *du = container_of(timeout, struct dispatch_ubus, timeout);
+	struct client *cl = uh_ubus_stream_client(du);
+
+	if (!uh_ubus_stream_blocked(cl))
+		ops->chunk_printf(cl, ": ping\n\n");
+
+	uloop_timeout_set(timeout, max(conf.network_timeout, 2) * 500);
+}
+
+/* runs from a timer, subscribing is a synchronous ubus call */
+static void uh_ubus_stream_start_cb(struct uloop_timeout *timeout)
+{
+	struct dispatch_ubus *du = container_of(timeout, struct dispatch_ubus, timeout);
+	struct client *cl = uh_ubus_stream_client(du);
+	struct ubus_call *c = du->calls;
+
+	if (!c->allow)
+		return ops->client_error(cl, 403, "Forbidden", "Access to %s denied", c->object);
+
+	du->topic = uh_ubus_topic_get(c->object, c->id);
+	if (!du->topic)
+		return ops->client_error(cl, 500, "Internal Server Error",
+					 "Unable to subscribe to %s", c->object);
+
+	list_add_tail(&du->stream_list, &du->topic->clients);
+	cl->dispatch.write_cb = uh_ubus_stream_dropped;
+
+	ops->http_header(cl, 200, "OK");
+
+	if (conf.ubus_cors)
+		uh_ubus_add_cors_headers(cl);
+
+	ops->response_printf(cl, "Content-Type: text/event-stream\r\n");
+	ops->response_printf(cl, "Cache-Control: no-cache\r\n\r\n");
+	ops->response_flush(cl);
+
+	du->timeout.cb = uh_ubus_stream_ping_cb;
+	uloop_timeout_set(&du->timeout, max(conf.network_timeout, 2) * 500);
+}
+
+/* EventSource cannot set headers, so the session may come in the query */
+static bool uh_ubus_stream_sid(struct client *cl, const char *query, char *sid, int len)
+{
+	const char *auth = uh_header(cl, UH_HDR_AUTHORIZATION);
+	const char *p = NULL;
+	int i, n;
+
+	if (auth && !strncasecmp(auth, "Bearer ", 7)) {
+		p = auth + 7;
+	} else {
+		for (; query; query = strchr(query, '&')) {
+			query++;
+			if (!strncmp(query, "ubus_rpc_session=", 17)) {
+				p = query + 17;
+				break;
+			}
+		}
+	}
+
+	if (!p)
+		return false;
+
+	n = strcspn(p, "&");
+	if (!n || n >= len)
+		return false;
+
+	for (i = 0; i < n; i++)
+		if (!isalnum((unsigned char) p[i]))
+			return false;
+
+	memcpy(sid, p, n);
+	sid[n] = 0;
+
+	return true;
+}
+
+static void uh_ubus_handle_stream(struct client *cl, char *url)
+{
+	struct dispatch_ubus *du = &cl->dispatch.ubus;
+	char *path = url + strlen(conf.ubus_prefix);
+	char object[256], sid[64];
+	struct ubus_call *c;
+	char *query, *str;
+	int len;
+
+	if (strncmp(path, UH_UBUS_STREAM_PATH, strlen(UH_UBUS_STREAM_PATH)))
+		return ops->client_error(cl, 400, "Bad Request", "Invalid Request");
+
+	path += strlen(UH_UBUS_STREAM_PATH);
+	query = strchr(path, '?');
+
+	len = ops->urldecode(object, sizeof(object) - 1, path,
+			     query ? query - path : strlen(path));
+	if (len <= 0)
+		return ops->client_error(cl, 400, "Bad Request", "Invalid object path");
+
+	if (!uh_ubus_stream_sid(cl, query, sid, sizeof(sid))) {
+		if (!conf.ubus_noauth)
+			return ops->client_error(cl, 403, "Forbidden", "No session given");
+
+		strcpy(sid, UH_UBUS_DEFAULT_SID);
+	}
+
+	c = calloc(1, sizeof(*c) + len + strlen(sid) + 2);
+	if (!c)
+		return ops->client_error(cl, 500, "Internal Server Error", "Out of memory");
+
+	cl->dispatch.child_fds = uh_ubus_child_fds;
+	cl->dispatch.free = uh_ubus_request_free;
+	du->calls = c;
+	du->n_calls = 1;
+	du->stream = true;
+
+	str = (char *) (c + 1);
+	c->cl = cl;
+	c->object = strcpy(str, object);
+	c->sid = strcpy(str + len + 1, sid);
+	c->func = ":subscribe";
+
+	if (uh_ubus_lookup_id(c->object, &c->id))
+		return ops->client_error(cl, 404, "Not Found", "Object %s not found", c->object);
+
+	if (conf.ubus_noauth)
+		return uh_ubus_access_done(c, true);
+
+	uh_ubus_check_access(c);
+}
+
+static void uh_ubus_start_call(struct ubus_call *c)
+{
+	struct json_object *obj = c->obj;
 	struct rpc_data data = {};
 	enum rpc_error err = ERROR_PARSE;
 
-	uh_client_ref(cl);
-
-	if (json_object_get_type(obj) != json_type_object)
+	if (!obj || json_object_get_type(obj) != json_type_object)
 		goto error;
 
-	du->jsobj_cur = obj;
 	blob_buf_init(&buf, 0);
 	if (!blobmsg_add_object(&buf, obj))
 		goto error;
@@ -527,72 +1303,121 @@ static void uh_ubus_handle_request_object(struct client *cl, struct json_object
 	if (!parse_json_rpc(&data, buf.head))
 		goto error;
 
+	/* sid, object, function and args all point into params */
+	c->params = data.params;
+
 	if (!strcmp(data.method, "call")) {
 		if (!data.sid || !data.object || !data.function || !data.data)
 			goto error;
 
-		du->func = data.function;
-		if (ubus_lookup_id(ctx, data.object, &du->obj)) {
+		c->sid = data.sid;
+		c->object = data.object;
+		c->func = data.function;
+		c->args = data.data;
+
+		if (uh_ubus_lookup_id(data.object, &c->id)) {
 			err = ERROR_OBJECT;
 			goto error;
 		}
 
-		if (!conf.ubus_noauth && !uh_ubus_allowed(data.sid, data.object, data.function)) {
-			err = ERROR_ACCESS;
-			goto error;
-		}
+		if (conf.ubus_noauth)
+			return uh_ubus_send_request(c);
 
-		uh_ubus_send_request(cl, obj, data.sid, data.data);
-		goto out;
+		return uh_ubus_check_access(c);
 	}
 	else if (!strcmp(data.method, "list")) {
-		uh_ubus_send_list(cl, obj, data.params);
-		goto out;
+		return uh_ubus_send_list(c, data.params);
 	}
 	else {
 		err = ERROR_METHOD;
-		goto error;
 	}
 
 error:
-	uh_ubus_json_error(cl, err);
-out:
-	if (data.params)
-		free(data.params);
+	uh_ubus_json_error(c, err);
+}
+
+/*
+ * Start calls up to the concurrency limit and send the finished ones that
+ * are next in line, so the response keeps the order of the request.
+ */
+static void uh_ubus_pump(struct client *cl)
+{
+	struct dispatch_ubus *du = &cl->dispatch.ubus;
+	struct ubus_call *c;
+
+	uh_client_ref(cl);
+
+	while (du->n_started < du->n_calls &&
+	       du->n_active < UH_UBUS_MAX_CONCURRENT) {
+		c = &du->calls[du->n_started++];
+		du->n_active++;
+		uh_ubus_start_call(c);
+	}
+
+	while (du->n_sent < du->n_calls && du->calls[du->n_sent].done) {
+		c = &du->calls[du->n_sent];
+		if (!c->result) {
+			uh_ubus_init_error(c->obj, ERROR_INTERNAL);
+			uh_ubus_send_json(cl, du->n_sent ? "," : "", buf.head);
+		} else {
+			uh_ubus_send_json(cl, du->n_sent ? "," : "", c->result);
+		}
+
+		free(c->result);
+		c->result = NULL;
+		du->n_sent++;
+	}
+
+	if (du->n_sent == du->n_calls) {
+		if (du->array)
+			ops->chunk_printf(cl, "]");
+
+		ops->request_done(cl);
+	}
 
 	uh_client_unref(cl);
 }
 
-static void __uh_ubus_next_batched_request(struct uloop_timeout *timeout)
+static void uh_ubus_pump_cb(struct uloop_timeout *timeout)
 {
 	struct dispatch_ubus *du = container_of(timeout, struct dispatch_ubus, timeout);
 	struct client *cl = container_of(du, struct client, dispatch.ubus);
-	struct json_object *obj = du->jsobj;
-	int len;
-
-	len = json_object_array_length(obj);
-	if (du->array_idx >= len)
-		return uh_ubus_complete_batch(cl);
 
-	obj = json_object_array_get_idx(obj, du->array_idx++);
-	uh_ubus_handle_request_object(cl, obj);
+	uh_ubus_pump(cl);
 }
 
 static void uh_ubus_data_done(struct client *cl)
 {
 	struct dispatch_ubus *du = &cl->dispatch.ubus;
 	struct json_object *obj = du->jsobj;
+	int i, n = 1;
 
 	switch (obj ? json_object_get_type(obj) : json_type_null) {
 	case json_type_object:
-		uh_ubus_send_header(cl);
-		return uh_ubus_handle_request_object(cl, obj);
+		break;
 	case json_type_array:
-		uh_ubus_init_batch(cl);
-		return uh_ubus_next_batched_request(cl);
+		du->array = true;
+		n = json_object_array_length(obj);
+		break;
 	default:
 		return uh_ubus_single_error(cl, ERROR_PARSE);
 	}
+
+	du->calls = calloc(n ? n : 1, sizeof(*du->calls));
+	if (!du->calls)
+		return uh_ubus_single_error(cl, ERROR_INTERNAL);
+
+	du->n_calls = n;
+	for (i = 0; i < n; i++) {
+		du->calls[i].cl = cl;
+		du->calls[i].obj = du->array ? json_object_array_get_idx(obj, i) : obj;
+	}
+
+	uh_ubus_send_header(cl);
+	if (du->array)
+		ops->chunk_printf(cl, "[");
+
+	uh_ubus_pump(cl);
 }
 
 static int uh_ubus_data_send(struct client *cl, const char *data, int len)
@@ -625,11 +1450,15 @@ static void uh_ubus_handle_request(struct client *cl, char *url, struct path_inf
 	case UH_HTTP_MSG_POST:
 		d->data_send = uh_ubus_data_send;
 		d->data_done = uh_ubus_data_done;
-		d->close_fds = uh_ubus_close_fds;
+		d->child_fds = uh_ubus_child_fds;
 		d->free = uh_ubus_request_free;
 		d->ubus.jstok = json_tokener_new();
 		break;
 
+	case UH_HTTP_MSG_GET:
+		uh_ubus_handle_stream(cl, url);
+		break;
+
 	case UH_HTTP_MSG_OPTIONS:
 		uh_ubus_send_header(cl);
 		ops->request_done(cl);
@@ -650,6 +1479,7 @@ static int
 uh_ubus_init(void)
 {
 	static struct dispatch_handler ubus_dispatch = {
+		.type = UH_HANDLER_UBUS,
 		.check_url = uh_ubus_check_url,
 		.handle_request = uh_ubus_handle_request,
 	};
@@ -676,7 +1506,20 @@ static int uh_ubus_plugin_init(const struct uhttpd_ops *o, struct config *c)
 
 static void uh_ubus_post_init(void)
 {
+	/* worker processes must not share the supervisor's connection */
+	if (conf.workers > 1 && ubus_reconnect(ctx, conf.ubus_socket)) {
+		fprintf(stderr, "Unable to connect to ubus socket\n");
+		exit(1);
+	}
+
 	ubus_add_uloop(ctx);
+
+	session_sub.cb = uh_ubus_session_notify;
+	session_sub.remove_cb = uh_ubus_session_remove;
+	ubus_register_subscriber(ctx, &session_sub);
+
+	obj_event.cb = uh_ubus_obj_event;
+	obj_cache_valid = !ubus_register_event_handler(ctx, &obj_event, "ubus.object.*");
 }
 
 struct uhttpd_plugin uhttpd_plugin = {
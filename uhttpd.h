@@ -40,9 +40,17 @@
 #include "utils.h"
 
 #define UH_LIMIT_CLIENTS	64
+#define UH_LIMIT_RANGES		8
+#define UH_LIMIT_PIPELINE	8
+#define UH_LIMIT_ACCEPT		16
 
-#define __enum_header(_name, _val) HDR_##_name,
-#define __blobmsg_header(_name, _val) [HDR_##_name] = { .name = #_val, .type = BLOBMSG_TYPE_STRING },
+#define UH_SCRIPT_RETRY_AFTER	5
+
+#define UH_PIPE_SIZE		(128 * 1024)
+#define UH_SPLICE_MIN		(64 * 1024)
+#define UH_ARENA_SIZE		2048
+
+#define UH_METRIC_BUCKETS	12
 
 struct client;
 
@@ -56,20 +64,34 @@ struct config {
 	const char *cgi_path;
 	const char *lua_handler;
 	const char *lua_prefix;
+	int lua_workers;
 	const char *ubus_prefix;
 	const char *ubus_socket;
 	int no_symlinks;
 	int no_dirlists;
+	int precompressed;
 	int network_timeout;
 	int rfc1918_filter;
 	int tls_redirect;
+	int tls_rotate;
 	int tcp_keepalive;
+	int listen_backlog;
+	int tcp_defer_accept;
+	int tcp_fastopen;
 	int max_script_requests;
+	int max_script_queue;
 	int max_connections;
+	int workers;
 	int http_keepalive;
 	int script_timeout;
+	int path_cache_ttl;
+	int auth_cache_ttl;
+	int dirlist_cache_ttl;
+	int file_cache_size;
+	int file_cache_max;
 	int ubus_noauth;
 	int ubus_cors;
+	const char *status_prefix;
 };
 
 struct auth_realm {
@@ -104,6 +126,65 @@ enum http_user_agent {
 	UH_UA_MSIE_NEW,
 };
 
+enum uh_handler {
+	UH_HANDLER_OTHER,
+	UH_HANDLER_FILE,
+	UH_HANDLER_CGI,
+	UH_HANDLER_LUA,
+	UH_HANDLER_UBUS,
+	UH_HANDLER_FCGI,
+	UH_HANDLER_STATUS,
+	__UH_HANDLER_MAX,
+};
+
+enum uh_timing {
+	UH_TIMING_RELAY,
+	UH_TIMING_UBUS_CALL,
+	__UH_TIMING_MAX,
+};
+
+struct uh_histogram {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t buckets[UH_METRIC_BUCKETS];
+};
+
+struct uh_metrics {
+	uint64_t connections;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t responses[5];
+	struct uh_histogram requests[__UH_HANDLER_MAX];
+	struct uh_histogram timings[__UH_TIMING_MAX];
+};
+
+enum uh_header {
+	UH_HDR_ACCEPT,
+	UH_HDR_ACCEPT_CHARSET,
+	UH_HDR_ACCEPT_ENCODING,
+	UH_HDR_ACCEPT_LANGUAGE,
+	UH_HDR_AUTHORIZATION,
+	UH_HDR_CONNECTION,
+	UH_HDR_COOKIE,
+	UH_HDR_HOST,
+	UH_HDR_REFERER,
+	UH_HDR_USER_AGENT,
+	UH_HDR_CONTENT_TYPE,
+	UH_HDR_CONTENT_LENGTH,
+	UH_HDR_IF_MODIFIED_SINCE,
+	UH_HDR_IF_UNMODIFIED_SINCE,
+	UH_HDR_IF_MATCH,
+	UH_HDR_IF_NONE_MATCH,
+	UH_HDR_IF_RANGE,
+	UH_HDR_RANGE,
+	UH_HDR_EXPECT,
+	UH_HDR_TRANSFER_ENCODING,
+	UH_HDR_ORIGIN,
+	UH_HDR_ACCESS_CONTROL_REQUEST_METHOD,
+	UH_HDR_ACCESS_CONTROL_REQUEST_HEADERS,
+	__UH_HDR_MAX,
+};
+
 struct http_request {
 	enum http_method method;
 	enum http_version version;
@@ -115,6 +196,9 @@ struct http_request {
 	bool respond_chunked;
 	uint8_t transfer_chunked;
 	const struct auth_realm *realm;
+	enum uh_handler handler;
+	uint64_t start;
+	int hdr[__UH_HDR_MAX];
 };
 
 enum client_state {
@@ -158,9 +242,15 @@ struct relay {
 	bool process_done;
 	bool error;
 	bool skip_data;
+	bool splice;
+	bool splicing;
+
+	struct uloop_fd splice_rd;
+	struct uloop_fd splice_wr;
 
 	int ret;
 	int header_ofs;
+	uint64_t start;
 
 	void (*header_cb)(struct relay *r, const char *name, const char *value);
 	void (*header_end)(struct relay *r);
@@ -176,9 +266,43 @@ struct dispatch_proc {
 	char *status_msg;
 };
 
+struct file_range {
+	off_t start;
+	off_t end;
+};
+
+struct dispatch_file {
+	struct uloop_fd wrfd;
+	bool sendfile;
+	int fd;
+
+	off_t size;
+	off_t pos, end;
+	const char *mime;
+	const char *encoding;
+	char boundary[24];
+	int range, n_ranges;
+	struct file_range ranges[UH_LIMIT_RANGES];
+};
+
+struct fcgi_conn;
+
+struct dispatch_fcgi {
+	struct uloop_timeout timeout;
+	struct fcgi_conn *conn;
+	struct blob_buf hdr;
+	char *hdr_buf;
+	int hdr_len;
+	int status_code;
+	char *status_msg;
+	bool header_done;
+	bool data_done;
+};
+
 struct dispatch_handler {
 	struct list_head list;
 	bool script;
+	enum uh_handler type;
 
 	bool (*check_url)(const char *url);
 	bool (*check_path)(struct path_info *pi, const char *url);
@@ -186,30 +310,38 @@ struct dispatch_handler {
 };
 
 #ifdef HAVE_UBUS
-struct dispatch_ubus {
-	struct ubus_request req;
+struct ubus_call;
+struct ubus_stream_topic;
 
+struct dispatch_ubus {
 	struct uloop_timeout timeout;
 	struct json_tokener *jstok;
 	struct json_object *jsobj;
-	struct json_object *jsobj_cur;
 	int post_len;
 
-	uint32_t obj;
-	const char *func;
-
-	struct blob_buf buf;
-	bool req_pending;
+	struct ubus_call *calls;
+	int n_calls;
+	int n_started;
+	int n_active;
+	int n_sent;
 	bool array;
-	int array_idx;
+
+	/* event stream of object notifications */
+	bool stream;
+	struct ubus_stream_topic *topic;
+	struct list_head stream_list;
+	int n_dropped;
 };
 #endif
 
+#define UH_DISPATCH_FDS	4
+
 struct dispatch {
 	int (*data_send)(struct client *cl, const char *data, int len);
 	void (*data_done)(struct client *cl);
 	void (*write_cb)(struct client *cl);
-	void (*close_fds)(struct client *cl);
+	/* report up to UH_DISPATCH_FDS descriptors a child must not inherit */
+	int (*child_fds)(struct client *cl, int *fds);
 	void (*free)(struct client *cl);
 
 	void *req_data;
@@ -218,11 +350,9 @@ struct dispatch {
 	bool data_blocked;
 
 	union {
-		struct {
-			struct blob_attr **hdr;
-			int fd;
-		} file;
+		struct dispatch_file file;
 		struct dispatch_proc proc;
+		struct dispatch_fcgi fcgi;
 #ifdef HAVE_UBUS
 		struct dispatch_ubus ubus;
 #endif
@@ -238,9 +368,15 @@ struct client {
 	struct ustream_fd sfd;
 #ifdef HAVE_TLS
 	struct ustream_ssl ssl;
+	void *tls_ctx;
 #endif
 	struct uloop_timeout timeout;
+	uint64_t active;
+	int idle;
 	int requests;
+	int pipelined;
+	bool pipeline;
+	bool yield;
 
 	enum client_state state;
 	bool tls;
@@ -251,26 +387,53 @@ struct client {
 
 	struct blob_buf hdr;
 	struct dispatch dispatch;
+
+	/* per-request allocations, released in bulk by uh_request_done() */
+	char *arena;
+	int arena_used;
+	struct uh_arena_extra *arena_extra;
 };
 
+/* value of a known request header or NULL, without parsing cl->hdr again */
+static inline char *uh_header(struct client *cl, enum uh_header idx)
+{
+	if (!cl->request.hdr[idx])
+		return NULL;
+
+	return (char *) cl->hdr.head + cl->request.hdr[idx];
+}
+
 extern char uh_buf[4096];
 extern int n_clients;
 extern struct config conf;
 extern const char * const http_versions[];
 extern const char * const http_methods[];
 extern struct dispatch_handler cgi_dispatch;
+extern struct uh_metrics uh_metrics;
 
 void uh_index_add(const char *filename);
+void uh_mime_add(const char *ext, const char *mime);
 
-bool uh_accept_client(int fd, bool tls);
+bool uh_accept_client(int fd, bool tls, void *srv_addr);
 
 void uh_unblock_listeners(void);
 void uh_setup_listeners(void);
 int uh_socket_bind(const char *host, const char *port, bool tls);
+int uh_socket_reuseport(void);
 
 int uh_first_tls_port(int family);
+int uh_blocked_listeners(void);
 
 bool uh_use_chunked(struct client *cl);
+
+void uh_response_write(struct client *cl, const void *data, int len);
+void uh_response_vprintf(struct client *cl, const char *format, va_list arg);
+
+void __printf(2, 3)
+uh_response_printf(struct client *cl, const char *format, ...);
+
+void uh_response_flush(struct client *cl);
+
 void uh_chunk_write(struct client *cl, const void *data, int len);
 void uh_chunk_vprintf(struct client *cl, const char *format, va_list arg);
 
@@ -287,16 +450,22 @@ uh_client_error(struct client *cl, int code, const char *summary, const char *fm
 void uh_handle_request(struct client *cl);
 void client_poll_post_data(struct client *cl);
 void uh_client_read_cb(struct client *cl);
+int uh_header_lookup(const char *name, int len);
+void uh_client_touch(struct client *cl);
+void *uh_arena_alloc(struct client *cl, int len);
 void uh_client_notify_state(struct client *cl);
 
 void uh_auth_add(const char *path, const char *user, const char *pass);
 bool uh_auth_check(struct client *cl, struct path_info *pi);
 
-void uh_close_listen_fds(void);
+int uh_listen_fds(int *fds);
 void uh_close_fds(void);
+void uh_close_client_fds(void);
+int *uh_child_fds(int *n);
 
 void uh_interpreter_add(const char *ext, const char *path);
 void uh_dispatch_add(struct dispatch_handler *d);
+const char *uh_file_mime_lookup(const char *path);
 
 void uh_relay_open(struct client *cl, struct relay *r, int fd, int pid);
 void uh_relay_close(struct relay *r, int ret);
@@ -304,9 +473,21 @@ void uh_relay_free(struct relay *r);
 void uh_relay_kill(struct client *cl, struct relay *r);
 
 struct env_var *uh_get_process_vars(struct client *cl, struct path_info *pi);
+int uh_fcgi_add(const char *prefix, const char *addr);
+
+bool uh_spawn_process(struct client *cl, const char *dir,
+		      char *const argv[], char *const envp[]);
+bool uh_create_pipe_process(struct client *cl, int pid, int fds[2]);
 bool uh_create_process(struct client *cl, struct path_info *pi, char *url,
 		       void (*cb)(struct client *cl, struct path_info *pi, char *url));
 
+void uh_script_requests(int *running, int *queued);
+
+uint64_t uh_metrics_now(void);
+void uh_metrics_timing(enum uh_timing type, uint64_t start);
+void uh_metrics_request_done(struct client *cl);
+void uh_metrics_init(void);
+
 int uh_plugin_init(const char *name);
 void uh_plugin_post_init(void);
 
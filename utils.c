@@ -18,6 +18,7 @@
  */
 
 #include <ctype.h>
+#include <strings.h>
 #include "uhttpd.h"
 
 bool uh_use_chunked(struct client *cl)
@@ -35,6 +36,101 @@ bool uh_use_chunked(struct client *cl)
 	return true;
 }
 
+/*
+ * Response headers and chunk framing are collected here and go out with a
+ * single ustream_write(), instead of one write per line. Only one client
+ * can have pending data at a time; it is flushed as soon as another client
+ * starts a response, by the uh_chunk_*() functions and when the request is
+ * done. Code which returns to the event loop right after sending a header,
+ * or which writes to the stream directly, calls uh_response_flush() first.
+ */
+static struct {
+	struct client *cl;
+	int len;
+	char data[4096];
+} resp;
+
+void uh_response_flush(struct client *cl)
+{
+	if (resp.cl != cl)
+		return;
+
+	if (resp.len && cl->state != CLIENT_STATE_CLEANUP) {
+		ustream_write(cl->us, resp.data, resp.len, true);
+		uh_metrics.bytes_out += resp.len;
+	}
+
+	resp.cl = NULL;
+	resp.len = 0;
+}
+
+static void uh_response_claim(struct client *cl, int len)
+{
+	if (resp.cl != cl && resp.cl)
+		uh_response_flush(resp.cl);
+
+	if (resp.len + len > sizeof(resp.data))
+		uh_response_flush(cl);
+
+	resp.cl = cl;
+}
+
+void uh_response_write(struct client *cl, const void *data, int len)
+{
+	uh_response_claim(cl, len);
+	if (len > sizeof(resp.data)) {
+		uh_response_flush(cl);
+		ustream_write(cl->us, data, len, true);
+		uh_metrics.bytes_out += len;
+		return;
+	}
+
+	memcpy(resp.data + resp.len, data, len);
+	resp.len += len;
+}
+
+void uh_response_vprintf(struct client *cl, const char *format, va_list arg)
+{
+	va_list arg2;
+	int len;
+
+	uh_response_claim(cl, 0);
+
+	va_copy(arg2, arg);
+	len = vsnprintf(resp.data + resp.len, sizeof(resp.data) - resp.len, format, arg2);
+	va_end(arg2);
+
+	if (resp.len + len < sizeof(resp.data)) {
+		resp.len += len;
+		return;
+	}
+
+	uh_response_flush(cl);
+	if (len < sizeof(resp.data)) {
+		resp.cl = cl;
+		resp.len = vsnprintf(resp.data, sizeof(resp.data), format, arg);
+		return;
+	}
+
+	uh_metrics.bytes_out += ustream_vprintf(cl->us, format, arg);
+}
+
+void uh_response_printf(struct client *cl, const char *format, ...)
+{
+	va_list arg;
+
+	va_start(arg, format);
+	uh_response_vprintf(cl, format, arg);
+	va_end(arg);
+}
+
+static void uh_chunk_frame(struct client *cl, int len)
+{
+	char buf[16];
+
+	uh_response_write(cl, buf, snprintf(buf, sizeof(buf), "%X\r\n", len));
+}
+
 void uh_chunk_write(struct client *cl, const void *data, int len)
 {
 	bool chunked = cl->request.respond_chunked;
@@ -42,12 +138,13 @@ void uh_chunk_write(struct client *cl, const void *data, int len)
 	if (cl->state == CLIENT_STATE_CLEANUP)
 		return;
 
-	uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
+	uh_client_touch(cl);
 	if (chunked)
-		ustream_printf(cl->us, "%X\r\n", len);
-	ustream_write(cl->us, data, len, true);
+		uh_chunk_frame(cl, len);
+	uh_response_write(cl, data, len);
 	if (chunked)
-		ustream_printf(cl->us, "\r\n", len);
+		uh_response_write(cl, "\r\n", 2);
+	uh_response_flush(cl);
 }
 
 void uh_chunk_vprintf(struct client *cl, const char *format, va_list arg)
@@ -59,9 +156,10 @@ void uh_chunk_vprintf(struct client *cl, const char *format, va_list arg)
 	if (cl->state == CLIENT_STATE_CLEANUP)
 		return;
 
-	uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
+	uh_client_touch(cl);
 	if (!cl->request.respond_chunked) {
-		ustream_vprintf(cl->us, format, arg);
+		uh_response_vprintf(cl, format, arg);
+		uh_response_flush(cl);
 		return;
 	}
 
@@ -69,12 +167,13 @@ void uh_chunk_vprintf(struct client *cl, const char *format, va_list arg)
 	len = vsnprintf(buf, sizeof(buf), format, arg2);
 	va_end(arg2);
 
-	ustream_printf(cl->us, "%X\r\n", len);
+	uh_chunk_frame(cl, len);
 	if (len < sizeof(buf))
-		ustream_write(cl->us, buf, len, true);
+		uh_response_write(cl, buf, len);
 	else
-		ustream_vprintf(cl->us, format, arg);
-	ustream_printf(cl->us, "\r\n", len);
+		uh_response_vprintf(cl, format, arg);
+	uh_response_write(cl, "\r\n", 2);
+	uh_response_flush(cl);
 }
 
 void uh_chunk_printf(struct client *cl, const char *format, ...)
@@ -88,13 +187,10 @@ void uh_chunk_printf(struct client *cl, const char *format, ...)
 
 void uh_chunk_eof(struct client *cl)
 {
-	if (!cl->request.respond_chunked)
-		return;
+	if (cl->request.respond_chunked && cl->state != CLIENT_STATE_CLEANUP)
+		uh_response_write(cl, "0\r\n\r\n", 5);
 
-	if (cl->state == CLIENT_STATE_CLEANUP)
-		return;
-
-	ustream_printf(cl->us, "0\r\n\r\n");
+	uh_response_flush(cl);
 }
 
 /* blen is the size of buf; slen is the length of src.  The input-string need
@@ -231,6 +327,114 @@ char *uh_split_header(char *str)
 	return val;
 }
 
+static const char uh_date_wdays[] = "SunMonTueWedThuFriSat";
+static const char uh_date_months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+/* Formats ts as RFC 7231 IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT",
+** without going through gmtime() and the locale dependent strftime(). */
+char *uh_unix2date(time_t ts, char *buf, int len)
+{
+	int64_t days = ts / 86400;
+	int secs = ts % 86400;
+	int64_t era, year;
+	unsigned int doe, yoe, doy, mp, day, mon;
+	int wday;
+
+	if (secs < 0) {
+		secs += 86400;
+		days--;
+	}
+
+	wday = (days + 4) % 7;
+	if (wday < 0)
+		wday += 7;
+
+	/* civil from days, see http://howardhinnant.github.io/date_algorithms.html */
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	day = doy - (153 * mp + 2) / 5 + 1;
+	mon = mp < 10 ? mp + 3 : mp - 9;
+	year = yoe + era * 400 + (mon <= 2);
+
+	snprintf(buf, len, "%.3s, %02u %.3s %04" PRId64 " %02d:%02d:%02d GMT",
+		 &uh_date_wdays[wday * 3], day, &uh_date_months[(mon - 1) * 3],
+		 year, secs / 3600, secs / 60 % 60, secs % 60);
+
+	return buf;
+}
+
+static int uh_date_digits(const char *str, int n)
+{
+	int val = 0;
+
+	while (n--) {
+		if (!isdigit(*str))
+			return -1;
+
+		val = val * 10 + (*str++ - '0');
+	}
+
+	return val;
+}
+
+/* Parses an RFC 7231 IMF-fixdate, returns 0 if the date is malformed */
+time_t uh_date2unix(const char *date)
+{
+	const char *p = strchr(date, ',');
+	int day, mon, year, hour, min, sec;
+	int64_t days;
+
+	/* " 06 Nov 1994 08:49:37 GMT" */
+	if (!p || strlen(p) < 26 || p[1] != ' ' || p[4] != ' ' || p[8] != ' ' ||
+	    p[13] != ' ' || p[16] != ':' || p[19] != ':' || p[22] != ' ' ||
+	    strncmp(p + 23, "GMT", 3))
+		return 0;
+
+	for (mon = 0; mon < 12; mon++)
+		if (!strncasecmp(p + 5, &uh_date_months[mon * 3], 3))
+			break;
+
+	day = uh_date_digits(p + 2, 2);
+	year = uh_date_digits(p + 9, 4);
+	hour = uh_date_digits(p + 14, 2);
+	min = uh_date_digits(p + 17, 2);
+	sec = uh_date_digits(p + 20, 2);
+
+	if (mon == 12 || day < 1 || day > 31 || year < 1970 ||
+	    hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+		return 0;
+
+	/* days from civil */
+	mon++;
+	year -= mon <= 2;
+	days = year / 400 * 146097;
+	year %= 400;
+	days += year * 365 + year / 4 - year / 100 +
+		(153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+	days -= 719468;
+
+	return days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+/* Current time as HTTP date, only reformatted when the second changes */
+const char *uh_http_date(void)
+{
+	static char buf[32];
+	static time_t last;
+	time_t now = time(NULL);
+
+	if (now != last || !buf[0]) {
+		uh_unix2date(now, buf, sizeof(buf));
+		last = now;
+	}
+
+	return buf;
+}
+
 bool uh_addr_rfc1918(struct uh_addr *addr)
 {
 	uint32_t a;
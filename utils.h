@@ -72,6 +72,9 @@ int uh_urlencode(char *buf, int blen, const char *src, int slen);
 int uh_b64decode(char *buf, int blen, const void *src, int slen);
 bool uh_path_match(const char *prefix, const char *url);
 char *uh_split_header(char *str);
+char *uh_unix2date(time_t ts, char *buf, int len);
+time_t uh_date2unix(const char *date);
+const char *uh_http_date(void);
 bool uh_addr_rfc1918(struct uh_addr *addr);
 
 #endif